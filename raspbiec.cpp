@@ -19,30 +19,47 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <iterator>
 #include "raspbiec.h"
 #include "raspbiec_utils.h"
+#include "raspbiec_listing.h"
 #include "raspbiec_exception.h"
 #include "raspbiec_drive.h"
+#include "raspbiec_daemon.h"
+#include "raspbiec_batch.h"
 
 // How to allocate the processes/threads when processing disk image command,
 // i.e. does computer or drive portion get the foreground
 // (== debug prints and debugger breakpoints)
 static const bool foreground_drive = true;
 
-enum raspbiec_mode {
-	MODE_NONE,
-	MODE_SERVE,
-	MODE_LOAD,
-	MODE_SAVE,
-	MODE_COMMAND,
-	MODE_ERROR_CHANNEL
+// Drive (MODE_SERVE) or computer operation with its end of the bus
+struct bus_job
+{
+	bus_job(int mode_, const char *path_, const char *string_,
+			int devicenum_, bool foreground_) :
+		mode(mode_), path(path_), string(string_),
+		devicenum(devicenum_), foreground(foreground_),
+		status(IEC_OK) {}
+
+	int mode;
+	const char *path;   // Directory or disk image to serve
+	const char *string; // Filename or command for the computer
+	int devicenum;
+	bool foreground;
+	pipefd bus;
+	int status; // Error from a thread, IEC_OK if none
 };
 
-raspbiec_mode determine_mode(const char *s);
+static void run_job(bus_job &job);
+static void *run_job_thread(void *arg);
+static int run_threaded(const char *image, int mode, const char *string, int devicenum);
+static int run_forked(const char *dir, int mode, const char *string, int devicenum);
+static int run_direct(const char *image, int mode, const char *string);
 
 int main(int argc, char** argv)
 {
@@ -52,10 +69,17 @@ int main(int argc, char** argv)
 		char *bname = basename(basec);
 		printf("As drive:    %s [serve] <directory or disk image> [<command>|<device #>]\n", bname);
 		printf("              <command> is a computer command below applied to the disk image\n");
+		printf("              load and save access the disk image directly unless 'serve' is given,\n");
+		printf("              which runs them through the emulated bus\n");
 		printf("As computer: %s load <filename> [<device #>]\n", bname);
 		printf("             %s save <filename> [<device #>]\n", bname);
 		printf("             %s cmd <command> [<device #>]\n", bname);
 		printf("             %s errch [<device #>]\n", bname);
+		printf("             %s batch <script> [<device #>]\n", bname);
+		printf("              <script> has one load, save, cmd or errch per line\n");
+		printf("             %s daemon [<socket>]\n", bname);
+		printf("              keeps the bus open and runs the computer commands above\n");
+		printf("              when RASPBIEC_SOCKET names its socket\n");
 		free(basec);
 		return EXIT_SUCCESS;
 	}
@@ -67,6 +91,8 @@ int main(int argc, char** argv)
 
 	int primary_mode = determine_mode(argv[1]);
 	int secondary_mode = MODE_NONE;
+	// Explicit 'serve' keeps disk image commands on the emulated bus
+	const bool bus_emulation = (primary_mode == MODE_SERVE);
 
 	int mode = primary_mode;
 	bool handing_secondary_mode = false;
@@ -97,12 +123,27 @@ int main(int argc, char** argv)
 			devicenum = (an < argc) ? strtol(argv[an], NULL, 10) : 8;
 			break;
 
+		case MODE_BATCH:
+			string    = (an < argc) ? argv[an] : NULL;
+			devicenum = (an+1 < argc) ? strtol(argv[an+1], NULL, 10) : 8;
+            if (!string) fprintf(stderr,"Missing batch script\n");
+			break;
+
+		case MODE_DAEMON:
+			string    = (an < argc) ? argv[an] : daemon_socket_path();
+			devicenum = 8;
+			break;
+
         case MODE_NONE:
             primary_mode = MODE_SERVE;
 			--an; // argv[1] was not a reserved word for mode
 		case MODE_SERVE:
 			dir_or_image = (an < argc) ? argv[an] : ".";
 			secondary_mode = (an+1 < argc) ? determine_mode(argv[an+1]) : MODE_NONE;
+			if (secondary_mode == MODE_DAEMON)
+			{
+				secondary_mode = MODE_NONE; // Not a disk image command
+			}
 			if (!handing_secondary_mode && secondary_mode != MODE_NONE)
 			{
 				// command for diskimage was found
@@ -123,91 +164,220 @@ int main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
+	if (primary_mode != MODE_SERVE && primary_mode != MODE_DAEMON &&
+		primary_mode != MODE_BATCH && getenv("RASPBIEC_SOCKET") != NULL)
+	{
+		// Queue the job in the daemon which has the bus open
+		return submit_daemon_job(daemon_socket_path(), primary_mode, string, devicenum);
+	}
+
 	try
 	{
-		pipefd communication_bus;
-		bool wait_for_child = false;
-		bool foreground = true;
+		if (primary_mode == MODE_DAEMON)
+		{
+			raspbiec_daemon daemon(string);
+			daemon.run();
+			return EXIT_SUCCESS;
+		}
 
-		mode = primary_mode;
 		if (primary_mode == MODE_SERVE && secondary_mode != MODE_NONE)
 		{
-			// Diskimage operation, fork drive and computer parts to separate processes
-			communication_bus.open_pipe();
-			pid_t cpid = fork();
-			if (cpid == -1)
-			{
-				throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
-			}
-			else if ((!foreground_drive && cpid == 0) || /* Drive process (child) */
-                     (foreground_drive && cpid != 0))    /* Drive process (parent) */
+			struct stat sb;
+			if (stat(dir_or_image, &sb) == 0 && S_ISREG(sb.st_mode))
 			{
-				wait_for_child = foreground_drive;
-				foreground = foreground_drive;
-				communication_bus.set_direction_B_to_A();
-				drive virtual_c1541(devicenum, communication_bus, foreground);
-				virtual_c1541.serve(dir_or_image);
-			}
-			else /* Computer process */
-			{
-				wait_for_child = !foreground_drive;
-				foreground = !foreground_drive;
-				communication_bus.set_direction_A_to_B();
-				mode = secondary_mode;
+				if (!bus_emulation &&
+					(secondary_mode == MODE_LOAD || secondary_mode == MODE_SAVE))
+				{
+					// Plain file copy, no need for the bus
+					return run_direct(dir_or_image, secondary_mode, string);
+				}
+				// Diskimage operation, run drive and computer parts
+				// as threads of this process
+				return run_threaded(dir_or_image, secondary_mode, string, devicenum);
 			}
-		}
-		else
-		{
-			communication_bus.open_dev(); // actual IEC bus
+			// Directory operation, fork drive and computer parts to separate
+			// processes as the drive changes the working directory
+			return run_forked(dir_or_image, secondary_mode, string, devicenum);
 		}
 
-		switch(mode)
-		{
-		case MODE_SERVE: // Normal service to IEC bus
-		{
-			drive c1541(devicenum, communication_bus, foreground);
-			c1541.serve(dir_or_image);
-			break;
-		}
-		case MODE_LOAD:
-		{
-			computer c64(communication_bus, foreground);
-			c64.load(string, devicenum);
-			break;
-		}
-		case MODE_SAVE:
+		bus_job job(primary_mode, dir_or_image, string, devicenum, true);
+		job.bus.open_dev(); // actual IEC bus
+		run_job(job);
+	}
+	catch (raspbiec_error &e)
+	{
+		printf("%s\n",e.what());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void run_job(bus_job &job)
+{
+	switch(job.mode)
+	{
+	case MODE_SERVE: // Normal service to IEC bus
+	{
+		drive c1541(job.devicenum, job.bus, job.foreground);
+		c1541.serve(job.path);
+		break;
+	}
+	case MODE_LOAD:
+	{
+		computer c64(job.bus, job.foreground);
+		c64.load(job.string, job.devicenum);
+		break;
+	}
+	case MODE_SAVE:
+	{
+		computer c64(job.bus, job.foreground);
+		c64.save(job.string, job.devicenum);
+		break;
+	}
+	case MODE_COMMAND:
+	{
+		computer c64(job.bus, job.foreground);
+		c64.command(job.string, job.devicenum);
+		break;
+	}
+	case MODE_ERROR_CHANNEL:
+	{
+		computer c64(job.bus, job.foreground);
+		c64.read_error_channel(job.devicenum);
+		break;
+	}
+	case MODE_BATCH:
+	{
+		computer c64(job.bus, job.foreground);
+		batch_session batch(c64, job.devicenum);
+		if (batch.run(job.string) > 0)
 		{
-			computer c64(communication_bus, foreground);
-			c64.save(string, devicenum);
-			break;
+			throw raspbiec_error(IEC_GENERAL_ERROR);
 		}
-		case MODE_COMMAND:
+		break;
+	}
+	default:
+		throw raspbiec_error(IEC_UNKNOWN_MODE);
+		break;
+	}
+}
+
+static void *run_job_thread(void *arg)
+{
+	bus_job *job = static_cast<bus_job *>(arg);
+	try
+	{
+		run_job(*job);
+	}
+	catch (raspbiec_error &e)
+	{
+		printf("%s\n",e.what());
+		job->status = e.status();
+	}
+	// Let the other end see the end of the bus, in case the
+	// device never got hold of it
+	job->bus.close_pipe();
+	return NULL;
+}
+
+static int run_threaded(const char *image, int mode, const char *string, int devicenum)
+{
+	bus_job drive_job(MODE_SERVE, image, NULL, devicenum, foreground_drive);
+	bus_job computer_job(mode, NULL, string, devicenum, !foreground_drive);
+	computer_job.bus.open_local(drive_job.bus);
+
+	// The background part gets the new thread
+	bus_job &fg = foreground_drive ? drive_job : computer_job;
+	bus_job &bg = foreground_drive ? computer_job : drive_job;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_job_thread, &bg) != 0)
+	{
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+	}
+	run_job_thread(&fg);
+	pthread_join(thread, NULL);
+
+	return (drive_job.status == IEC_OK && computer_job.status == IEC_OK) ?
+			EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_forked(const char *dir, int mode, const char *string, int devicenum)
+{
+	pipefd communication_bus;
+	communication_bus.open_ring();
+	pid_t cpid = fork();
+	if (cpid == -1)
+	{
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+	}
+
+	bool is_drive = (foreground_drive && cpid != 0) || /* Drive process (parent) */
+	                (!foreground_drive && cpid == 0);  /* Drive process (child) */
+	bus_job job(is_drive ? MODE_SERVE : mode, dir, string, devicenum,
+			is_drive == foreground_drive);
+	if (is_drive)
+	{
+		communication_bus.set_direction_B_to_A();
+	}
+	else
+	{
+		communication_bus.set_direction_A_to_B();
+	}
+	job.bus.move(communication_bus);
+	run_job_thread(&job);
+
+	if (cpid != 0)
+	{
+		int wstatus;
+		if (waitpid(cpid, &wstatus, 0) == cpid &&
+			(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS))
 		{
-			computer c64(communication_bus, foreground);
-			c64.command(string, devicenum);
-			break;
+			return EXIT_FAILURE;
 		}
-		case MODE_ERROR_CHANNEL:
+	}
+	return (job.status == IEC_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Load or save straight between the disk image and the local file
+static int run_direct(const char *image, int mode, const char *string)
+{
+	bool is_directory( string[0]=='$' );
+
+	std::vector<unsigned char> petsciiname;
+	ascii2petscii( std::string(string), petsciiname );
+
+	Diskimage img;
+	img.open(image);
+
+	databuf_t data;
+	if (mode == MODE_LOAD)
+	{
+		if (is_directory)
 		{
-			computer c64(communication_bus, foreground);
-			c64.read_error_channel(devicenum);
-			break;
-		}
-		default:
-			throw raspbiec_error(IEC_UNKNOWN_MODE);
-			break;
+			read_diskimage_dir(data, img, false, Diskimage::Dirfilter(petsciiname));
+			printf("%ld bytes\n", data.size());
+			basic_listing(data);
 		}
-
-		if (wait_for_child)
+		else
 		{
-	        wait(NULL);
+			if (local_file_exists(string))
+			{
+				printf("Not overwriting '%s'\n", string);
+				throw raspbiec_error(IEC_FILE_EXISTS);
+			}
+			img.read_file(data, petsciiname);
+			printf("%ld bytes\n", data.size());
+			write_local_file(data, string);
 		}
 	}
-	catch (raspbiec_error &e)
+	else // MODE_SAVE
 	{
-		printf("%s\n",e.what());
-		return EXIT_FAILURE;
+		read_local_file(data, string);
+		img.write_file(data, petsciiname);
+		printf("%ld bytes\n", data.size());
 	}
+	img.close();
 	return EXIT_SUCCESS;
 }
 
@@ -237,6 +407,14 @@ raspbiec_mode determine_mode(const char *s)
 	{
 		return MODE_SERVE;
 	}
+	else if (strcmp("batch",s) == 0)
+	{
+		return MODE_BATCH;
+	}
+	else if (strcmp("daemon",s) == 0)
+	{
+		return MODE_DAEMON;
+	}
 	// default
 	return MODE_NONE;
 }
@@ -244,7 +422,8 @@ raspbiec_mode determine_mode(const char *s)
 /*********************************************************************/
 
 computer::computer(pipefd &bus, const bool foreground) :
-    m_dev(foreground)
+    m_dev(foreground),
+    m_foreground(foreground)
 {
 	m_dev.set_identity(device::computer, bus);
 }
@@ -255,7 +434,7 @@ computer::~computer()
 
 void computer::load(const char* filename, int device_number)
 {
-	bool is_directory( strcmp(filename,"$")==0 );
+	bool is_directory( filename[0]=='$' );
 
 	if (!is_directory && local_file_exists(filename))
 	{
@@ -263,55 +442,74 @@ void computer::load(const char* filename, int device_number)
 		throw raspbiec_error(IEC_FILE_EXISTS);
 	}
 
-	databuf_t ram;
+	if (is_directory)
+	{
+		databuf_t ram;
+		receive_file(ram, filename, device_number);
+		if (m_foreground) basic_listing(ram);
+		return;
+	}
 
+	// Written as it arrives, the file appears when the load is complete
+	local_file_writer file(filename);
 	try
 	{
-		m_dev.load(back_inserter(ram), filename, device_number, 1);
-		printf("%ld bytes\n", ram.size());
+		m_dev.load(datasink_iterator(file), filename, device_number, 1);
+		file.commit();
+		printf("%ld bytes\n", file.size());
 	}
-	catch (raspbiec_error &e)
+	catch (raspbiec_error &)
 	{
-		printf("%s\n",e.what());
 		read_error_channel(device_number);
-		return;
+		throw;
 	}
+}
 
-	if (is_directory)
+void computer::receive_file(databuf_t &data, const char *filename, int device_number)
+{
+	try
 	{
-		if (m_foreground) basic_listing(ram);
+		m_dev.load(back_inserter(data), filename, device_number, 1);
+		printf("%ld bytes\n", data.size());
 	}
-	else
+	catch (raspbiec_error &)
 	{
-		write_local_file(ram, filename);
+		read_error_channel(device_number);
+		throw;
 	}
 }
 
 void computer::save(const char *filename, int device_number)
 {
-	databuf_t prg;
+	// Throws before the try, a missing host file is not the drive's
+	// error and its error channel is not read for it
+	int fd = open_local_file(filename, "r");
 	try
 	{
-		const_databuf_iter save_end = m_dev.save(prg.begin(), prg.end(), filename, device_number, 0);
-		printf("%ld bytes\n", save_end - prg.begin());
+		// Read ahead from the file while the previous part is on the bus
+		local_file_reader file(fd);
+		size_t saved = m_dev.save(file, filename, device_number, 0);
+		printf("%ld bytes\n", saved);
 	}
-	catch (raspbiec_error &e)
+	catch (raspbiec_error &)
 	{
-		printf("%s\n", e.what());
+		close_local_file(fd);
 		read_error_channel(device_number);
+		throw;
 	}
+	close_local_file(fd);
 }
 
-void computer::command(const char *command, int device_number)
+std::string computer::command(const char *command, int device_number)
 {
 	std::string asccmd(command);
 	std::vector<unsigned char> cmd;
 	ascii2petscii( asccmd, cmd );
 	m_dev.send_data( cmd.begin(), cmd.end(), device_number, 15 );
-	read_error_channel(device_number);
+	return read_error_channel(device_number);
 }
 
-void computer::read_error_channel(int device_number)
+std::string computer::read_error_channel(int device_number)
 {
 	std::vector<unsigned char> msg;
 	m_dev.receive_data(back_inserter(msg), device_number, 15);
@@ -319,4 +517,10 @@ void computer::read_error_channel(int device_number)
 	std::string ascmsg;
 	petscii2ascii( msg, ascmsg );
 	printf("%s\n", ascmsg.c_str());
+	return ascmsg;
+}
+
+void computer::clear_error()
+{
+	m_dev.clear_error();
 }
@@ -26,15 +26,34 @@
 #include "raspbiec_device.h"
 #include "raspbiec_diskimage.h"
 
+enum raspbiec_mode {
+	MODE_NONE,
+	MODE_SERVE,
+	MODE_LOAD,
+	MODE_SAVE,
+	MODE_COMMAND,
+	MODE_ERROR_CHANNEL,
+	MODE_DAEMON,
+	MODE_BATCH
+};
+
+raspbiec_mode determine_mode(const char *s);
+
 class computer
 {
 public:
     computer(pipefd &bus, const bool foreground);
     ~computer();
+    // Transfer errors are thrown after the error channel has been read
     void load(const char *filename, int device_number);
+    // Load into memory only, leaving the file for the caller to store
+    void receive_file(databuf_t &data, const char *filename, int device_number);
     void save(const char *filename, int device_number);
-    void command(const char *command, int device_number);
-    void read_error_channel(int device_number);
+    // Return the drive status from the error channel
+    std::string command(const char *command, int device_number);
+    std::string read_error_channel(int device_number);
+    // Get the bus usable again after an error
+    void clear_error();
 private:
     device m_dev;
     bool m_foreground;
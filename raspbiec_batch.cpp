@@ -0,0 +1,246 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "raspbiec_batch.h"
+#include "raspbiec_utils.h"
+#include "raspbiec_exception.h"
+
+static const char *op_names[] = { "load", "save", "cmd", "errch" };
+
+batch_session::batch_session(computer &c64, int device_number) :
+		m_c64(c64),
+		m_device_number(device_number),
+		m_stop(false),
+		m_write_failures(0)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	if (pthread_create(&m_thread, NULL, write_thread, this) != 0)
+	{
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_lock);
+		throw raspbiec_error(IEC_OUT_OF_MEMORY);
+	}
+}
+
+batch_session::~batch_session()
+{
+	pthread_mutex_lock(&m_lock);
+	m_stop = true;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(m_thread, NULL);
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+int batch_session::run(const char *script)
+{
+	std::vector<operation> ops;
+	parse(script, ops);
+
+	int failures = 0;
+	for (size_t i = 0; i < ops.size(); ++i)
+	{
+		const operation &op = ops[i];
+		printf("[%ld/%ld] %s %s\n", i+1, ops.size(), op_names[op.type], op.arg.c_str());
+		try
+		{
+			switch (op.type)
+			{
+			case OP_LOAD:
+				load(op.arg);
+				break;
+			case OP_SAVE:
+				// A file loaded earlier in the script may not be on disk yet
+				if (m_loaded.count(op.arg))
+					failures += wait_writes();
+				m_c64.save(op.arg.c_str(), m_device_number);
+				break;
+			case OP_COMMAND:
+				m_c64.command(op.arg.c_str(), m_device_number);
+				break;
+			case OP_ERROR_CHANNEL:
+				m_c64.read_error_channel(m_device_number);
+				break;
+			}
+		}
+		catch (raspbiec_error &e)
+		{
+			printf("Line %d: %s\n", op.line, e.what());
+			++failures;
+			m_c64.clear_error(); // Throws when the bus itself is gone
+		}
+	}
+	failures += wait_writes();
+	printf("%ld operations, %d failed\n", ops.size(), failures);
+	return failures;
+}
+
+// The whole script is checked before anything goes to the bus
+void batch_session::parse(const char *script, std::vector<operation> &ops)
+{
+	std::ifstream in(script);
+	if (!in)
+	{
+		fprintf(stderr, "Could not open batch script '%s'\n", script);
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+
+	std::string line;
+	int lineno = 0;
+	while (std::getline(in, line))
+	{
+		++lineno;
+		size_t begin = line.find_first_not_of(" \t\r");
+		if (begin == std::string::npos || line[begin] == '#')
+			continue;
+		size_t end = line.find_last_not_of(" \t\r") + 1;
+		size_t wordend = line.find_first_of(" \t", begin);
+		if (wordend == std::string::npos || wordend > end)
+			wordend = end;
+		std::string word(line, begin, wordend - begin);
+		size_t argbegin = line.find_first_not_of(" \t", wordend);
+		std::string arg;
+		if (argbegin != std::string::npos && argbegin < end)
+			arg.assign(line, argbegin, end - argbegin);
+
+		operation op;
+		op.line = lineno;
+		op.arg = arg;
+		bool needs_arg = true;
+		if (word == "load")
+			op.type = OP_LOAD;
+		else if (word == "save")
+			op.type = OP_SAVE;
+		else if (word == "cmd")
+			op.type = OP_COMMAND;
+		else if (word == "errch")
+		{
+			op.type = OP_ERROR_CHANNEL;
+			needs_arg = false;
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: unknown operation '%s'\n", script, lineno, word.c_str());
+			throw raspbiec_error(IEC_UNKNOWN_MODE);
+		}
+		if (needs_arg && arg.empty())
+		{
+			fprintf(stderr, "%s:%d: missing filename or command\n", script, lineno);
+			throw raspbiec_error(IEC_MISSING_FILENAME);
+		}
+		ops.push_back(op);
+	}
+}
+
+void batch_session::load(const std::string &filename)
+{
+	const char *name = filename.c_str();
+	if (name[0] == '$')
+	{
+		m_c64.load(name, m_device_number); // Listing is not saved
+		return;
+	}
+	// Files still waiting for the writer do not exist yet
+	if (m_loaded.count(filename) || local_file_exists(name))
+	{
+		printf("Not overwriting '%s'\n", name);
+		throw raspbiec_error(IEC_FILE_EXISTS);
+	}
+	databuf_t data;
+	m_c64.receive_file(data, name, m_device_number);
+	m_loaded.insert(filename);
+	queue_write(filename, data);
+}
+
+// Hand the data over to the writer, waits only while it is
+// max_pending files behind the bus
+void batch_session::queue_write(const std::string &name, databuf_t &data)
+{
+	pthread_mutex_lock(&m_lock);
+	while (m_pending.size() >= max_pending)
+	{
+		pthread_cond_wait(&m_cond, &m_lock);
+	}
+	m_pending.push_back(pending_file());
+	m_pending.back().name = name;
+	m_pending.back().data.swap(data);
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+}
+
+// Return the number of files which could not be written
+int batch_session::wait_writes()
+{
+	pthread_mutex_lock(&m_lock);
+	while (!m_pending.empty())
+	{
+		pthread_cond_wait(&m_cond, &m_lock);
+	}
+	int failures = m_write_failures;
+	m_write_failures = 0;
+	pthread_mutex_unlock(&m_lock);
+	return failures;
+}
+
+void *batch_session::write_thread(void *arg)
+{
+	static_cast<batch_session *>(arg)->write_files();
+	return NULL;
+}
+
+void batch_session::write_files()
+{
+	pthread_mutex_lock(&m_lock);
+	for (;;)
+	{
+		while (m_pending.empty() && !m_stop)
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+		}
+		if (m_pending.empty())
+			break; // Stopped and all written
+
+		// The front stays queued until written so that it counts
+		// against max_pending
+		pending_file &file = m_pending.front();
+		pthread_mutex_unlock(&m_lock);
+		bool ok = true;
+		try
+		{
+			write_local_file(file.data, file.name.c_str());
+		}
+		catch (raspbiec_error &)
+		{
+			ok = false;
+		}
+		pthread_mutex_lock(&m_lock);
+		if (!ok)
+		{
+			fprintf(stderr, "Could not write '%s'\n", file.name.c_str());
+			++m_write_failures;
+		}
+		m_pending.pop_front();
+		pthread_cond_broadcast(&m_cond);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
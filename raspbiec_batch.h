@@ -0,0 +1,85 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_BATCH_H
+#define RASPBIEC_BATCH_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include "raspbiec.h"
+
+/* Batch script, one operation per line:
+ *   load <filename>
+ *   save <filename>
+ *   cmd <command>
+ *   errch
+ * Empty lines and lines starting with '#' are skipped.
+ */
+
+// Runs a batch script over one computer, so the bus is opened and the
+// identity set only once. Loaded files are written out by a background
+// thread while the next file is on the bus. A failed operation does not
+// stop the batch. The error channel is read only when an operation
+// fails, or where the script has errch, typically as its last line.
+class batch_session
+{
+public:
+	batch_session(computer &c64, int device_number);
+	~batch_session();
+	// Return the number of failed operations
+	int run(const char *script);
+private:
+	batch_session(const batch_session &);
+	batch_session& operator=(const batch_session &);
+
+	enum op_type { OP_LOAD, OP_SAVE, OP_COMMAND, OP_ERROR_CHANNEL };
+	struct operation
+	{
+		op_type type;
+		std::string arg; // Filename or command
+		int line;
+	};
+	struct pending_file
+	{
+		std::string name;
+		databuf_t data;
+	};
+	static const size_t max_pending = 2; // Files waiting to be written
+
+	static void parse(const char *script, std::vector<operation> &ops);
+	void load(const std::string &filename);
+	void queue_write(const std::string &name, databuf_t &data);
+	int wait_writes();
+	static void *write_thread(void *arg);
+	void write_files();
+
+	computer &m_c64;
+	int m_device_number;
+	std::set<std::string> m_loaded; // Names loaded in this batch
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	std::deque<pending_file> m_pending;
+	bool m_stop;
+	int m_write_failures;
+};
+
+#endif // RASPBIEC_BATCH_H
@@ -1,6 +1,11 @@
 #ifndef RASPBIEC_COMMON_H
 #define RASPBIEC_COMMON_H
 
+/* Depth of the kernel module FIFOs, in bus entries (bytes or control codes).
+ * Userspace uses these to size its batched reads and writes. */
+#define RASPBIEC_READ_FIFO_SIZE 1024
+#define RASPBIEC_WRITE_FIFO_SIZE 1024
+
 /* Drive states */
 #define DEV_IDLE   0
 #define DEV_LISTEN 1
@@ -0,0 +1,548 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/fsuid.h>
+#include <grp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include "raspbiec_daemon.h"
+#include "raspbiec_utils.h"
+#include "raspbiec_transport.h"
+#include "raspbiec_exception.h"
+
+static const char *default_socket = "/run/raspbiec/raspbiec.sock";
+static const size_t max_request = 4096;
+static const long long job_read_timeout_ms = 5000;
+static const size_t max_pending = 32;
+
+static const char *mode_name(int mode)
+{
+	switch (mode)
+	{
+	case MODE_LOAD:          return "load";
+	case MODE_SAVE:          return "save";
+	case MODE_COMMAND:       return "cmd";
+	case MODE_ERROR_CHANNEL: return "errch";
+	default:                 return NULL;
+	}
+}
+
+static int socket_address(const char *path, struct sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path)
+	{
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	strcpy(addr.sun_path, path);
+	return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+// Read up to the end of line, false if the peer went away first
+static bool read_line(int fd, std::string &line)
+{
+	line.clear();
+	char c;
+	while (line.size() < max_request)
+	{
+		ssize_t rd = read(fd, &c, 1);
+		if (rd < 0 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			return false;
+		if (c == '\n')
+			return true;
+		line += c;
+	}
+	return false;
+}
+
+static void write_all(int fd, const std::string &s)
+{
+	size_t done = 0;
+	while (done < s.size())
+	{
+		// The client may be gone, which must not kill the daemon
+		ssize_t wr = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		if (wr <= 0)
+			return;
+		done += wr;
+	}
+}
+
+// Split at tabs into at most <count> fields, the last takes the rest
+static bool split_fields(const std::string &line, std::string *fields, int count)
+{
+	size_t start = 0;
+	for (int i = 0; i < count - 1; ++i)
+	{
+		size_t tab = line.find('\t', start);
+		if (tab == std::string::npos)
+			return false;
+		fields[i] = line.substr(start, tab - start);
+		start = tab + 1;
+	}
+	fields[count - 1] = line.substr(start);
+	return true;
+}
+
+// Nobody else may put another socket in place of the daemon's
+static void check_socket_dir(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+	std::string dir = (slash == std::string::npos) ? "." :
+		(slash == 0) ? "/" : path.substr(0, slash);
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		fprintf(stderr, "Could not create '%s', errno %d\n", dir.c_str(), errno);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	struct stat sb;
+	if (lstat(dir.c_str(), &sb) == -1 || !S_ISDIR(sb.st_mode) ||
+	    sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+	{
+		fprintf(stderr, "The socket directory '%s' must belong to the daemon's user "
+			"and be writable only by it\n", dir.c_str());
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+}
+
+// A socket left over from an earlier daemon is removed, anything else
+// in its place is not
+static void remove_stale_socket(const char *path)
+{
+	struct stat sb;
+	if (lstat(path, &sb) == -1)
+		return;
+	if (!S_ISSOCK(sb.st_mode))
+	{
+		fprintf(stderr, "'%s' exists and is not a socket\n", path);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	struct sockaddr_un addr;
+	int fd = socket_address(path, addr);
+	bool live = (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0);
+	if (fd >= 0) close(fd);
+	if (live)
+	{
+		fprintf(stderr, "A daemon is already listening on '%s'\n", path);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	unlink(path);
+}
+
+// A root daemon takes the client's filesystem ids for the job, these
+// are per thread. Other daemons run jobs of their own user only.
+static bool use_client_ids(uid_t uid, gid_t gid)
+{
+	if (geteuid() != 0)
+		return uid == geteuid();
+	setfsgid(gid);
+	setfsuid(uid);
+	return (uid_t)setfsuid(uid) == uid && (gid_t)setfsgid(gid) == gid;
+}
+
+static void use_own_ids()
+{
+	setfsuid(geteuid());
+	setfsgid(getegid());
+}
+
+raspbiec_daemon::raspbiec_daemon(const char *socket_path) :
+		m_path(socket_path),
+		m_listen(-1),
+		m_accepting(false)
+{
+	check_socket_dir(m_path);
+	remove_stale_socket(socket_path);
+
+	struct sockaddr_un addr;
+	m_listen = socket_address(socket_path, addr);
+	if (m_listen < 0)
+	{
+		fprintf(stderr, "Could not create socket, errno %d\n", errno);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	// Connecting needs write permission, given to the user and group
+	mode_t mask = umask(0117);
+	int bound = bind(m_listen, (struct sockaddr *)&addr, sizeof addr);
+	umask(mask);
+	if (bound == -1 || listen(m_listen, SOMAXCONN) == -1)
+	{
+		fprintf(stderr, "Could not listen on '%s', errno %d\n", socket_path, errno);
+		close(m_listen);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	// Those who may use the bus directly may also queue jobs. Without
+	// the rights to change it the group stays the daemon's.
+	struct stat dev;
+	if (stat(raspbiecdevname, &dev) == 0 && chown(socket_path, -1, dev.st_gid) == -1)
+	{
+		fprintf(stderr, "Socket '%s' is for the daemon's group only\n", socket_path);
+	}
+	if (pipe2(m_wake, O_CLOEXEC) == -1)
+	{
+		fprintf(stderr, "Could not create pipe, errno %d\n", errno);
+		close(m_listen);
+		unlink(socket_path);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+}
+
+raspbiec_daemon::~raspbiec_daemon()
+{
+	shut_down(IEC_GENERAL_ERROR, "Daemon stopped");
+	close(m_wake[0]);
+	unlink(m_path.c_str());
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+// No more jobs are taken and the queued ones are answered, the accept
+// thread answers the clients it has not yet queued
+void raspbiec_daemon::shut_down(int status, const char *message)
+{
+	if (m_wake[1] >= 0)
+	{
+		close(m_wake[1]);
+		m_wake[1] = -1;
+	}
+	if (m_accepting)
+	{
+		pthread_join(m_thread, NULL);
+		m_accepting = false;
+	}
+	if (m_listen >= 0)
+	{
+		close(m_listen);
+		m_listen = -1;
+	}
+	while (!m_queue.empty())
+	{
+		reply(m_queue.front().fd, status, message);
+		m_queue.pop_front();
+	}
+}
+
+// The bus is opened once, so the device is reset and told its
+// identity only at startup
+void raspbiec_daemon::run()
+{
+	pipefd bus;
+	bus.open_dev();
+	computer c64(bus, true);
+	// Only the client's own groups count for its files
+	if (geteuid() == 0 && setgroups(0, NULL) == -1)
+	{
+		fprintf(stderr, "Could not drop supplementary groups, errno %d\n", errno);
+		throw raspbiec_error(IEC_GENERAL_ERROR);
+	}
+
+	if (pthread_create(&m_thread, NULL, accept_thread, this) != 0)
+	{
+		throw raspbiec_error(IEC_OUT_OF_MEMORY);
+	}
+	m_accepting = true;
+
+	printf("Serving jobs on '%s'\n", m_path.c_str());
+	printf("Exit with Ctrl-C or SIGINT\n");
+	for (;;)
+	{
+		pthread_mutex_lock(&m_lock);
+		while (m_queue.empty())
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+		}
+		job j = m_queue.front();
+		m_queue.pop_front();
+		pthread_mutex_unlock(&m_lock);
+
+		int status;
+		std::string message;
+		try
+		{
+			run_job(c64, j, status, message);
+		}
+		catch (raspbiec_error &e)
+		{
+			reply(j.fd, e.status(), "Daemon lost the bus");
+			shut_down(e.status(), "Daemon lost the bus");
+			throw;
+		}
+		reply(j.fd, status, message);
+	}
+}
+
+void raspbiec_daemon::reply(int fd, int status, const std::string &message)
+{
+	char head[16];
+	snprintf(head, sizeof head, "%d\t", status);
+	write_all(fd, head + message + "\n");
+	close(fd);
+}
+
+void *raspbiec_daemon::accept_thread(void *arg)
+{
+	static_cast<raspbiec_daemon *>(arg)->accept_jobs();
+	return NULL;
+}
+
+// Clients are read as their lines arrive, so one that never finishes
+// its line holds up nobody and is dropped at its deadline
+void raspbiec_daemon::accept_jobs()
+{
+	std::vector<client> clients;
+	for (;;)
+	{
+		std::vector<struct pollfd> fds(2 + clients.size());
+		fds[0].fd = m_wake[0];
+		fds[0].events = POLLIN;
+		// Past the limit the rest wait in the listen backlog
+		fds[1].fd = (clients.size() < max_pending) ? m_listen : -1;
+		fds[1].events = POLLIN;
+		long long now = monotonic_ms();
+		long long timeout = -1;
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			fds[2 + i].fd = clients[i].fd;
+			fds[2 + i].events = POLLIN;
+			long long left = clients[i].deadline_ms - now;
+			if (left < 0) left = 0;
+			if (timeout < 0 || left < timeout) timeout = left;
+		}
+
+		int ret = poll(&fds[0], fds.size(), (int)timeout);
+		if (ret < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "Could not wait for jobs, errno %d\n", errno);
+			break;
+		}
+		if (ret > 0 && fds[0].revents != 0)
+			break;
+
+		// Backwards, so that the clients still match their pollfds
+		now = monotonic_ms();
+		for (size_t i = clients.size(); i-- > 0; )
+		{
+			bool done;
+			if (ret > 0 && fds[2 + i].revents != 0)
+			{
+				done = read_client(clients[i]);
+			}
+			else if (now >= clients[i].deadline_ms)
+			{
+				reply(clients[i].fd, -1, "Malformed job");
+				done = true;
+			}
+			else
+			{
+				done = false;
+			}
+			if (done)
+				clients.erase(clients.begin() + i);
+		}
+
+		if (ret > 0 && (fds[1].revents & POLLIN) != 0)
+		{
+			int fd = accept4(m_listen, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0)
+			{
+				client c;
+				c.fd = fd;
+				c.deadline_ms = now + job_read_timeout_ms;
+				clients.push_back(c);
+			}
+			else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+			{
+				fprintf(stderr, "Could not accept a job, errno %d\n", errno);
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		reply(clients[i].fd, -1, "Daemon stopped");
+	}
+}
+
+// Read what the client has sent, true once it is queued or refused
+bool raspbiec_daemon::read_client(client &c)
+{
+	char buf[256];
+	ssize_t rd = recv(c.fd, buf, sizeof buf, MSG_DONTWAIT);
+	if (rd < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	if (rd > 0)
+		c.line.append(buf, rd);
+
+	size_t end = c.line.find('\n');
+	if (end == std::string::npos && rd > 0 && c.line.size() < max_request)
+		return false;
+
+	job j;
+	struct ucred cred;
+	socklen_t credlen = sizeof cred;
+	if (end == std::string::npos || end > max_request ||
+	    getsockopt(c.fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+	    !parse_job(c.line.substr(0, end), j))
+	{
+		reply(c.fd, -1, "Malformed job");
+		return true;
+	}
+
+	j.fd = c.fd;
+	j.uid = cred.uid;
+	j.gid = cred.gid;
+	pthread_mutex_lock(&m_lock);
+	m_queue.push_back(j);
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	return true;
+}
+
+bool raspbiec_daemon::parse_job(const std::string &line, job &j)
+{
+	std::string fields[4];
+	if (!split_fields(line, fields, 4))
+		return false;
+
+	j.mode = determine_mode(fields[0].c_str());
+	j.devicenum = strtol(fields[1].c_str(), NULL, 10);
+	j.dir = fields[2];
+	j.string = fields[3];
+	return mode_name(j.mode) != NULL;
+}
+
+void raspbiec_daemon::run_job(computer &c64, const job &j, int &status, std::string &message)
+{
+	printf("Job %s \"%s\" in '%s'\n", mode_name(j.mode), j.string.c_str(), j.dir.c_str());
+	status = IEC_OK;
+	message = "OK";
+	try
+	{
+		// Files are read and written where the client is, as the client
+		if (!use_client_ids(j.uid, j.gid))
+		{
+			fprintf(stderr, "Jobs of user %d are not run here\n", (int)j.uid);
+			throw raspbiec_error(IEC_GENERAL_ERROR);
+		}
+		if (chdir(j.dir.c_str()) == -1)
+		{
+			fprintf(stderr, "Cannot change to directory '%s'\n", j.dir.c_str());
+			throw raspbiec_error(IEC_FILE_NOT_FOUND);
+		}
+		switch (j.mode)
+		{
+		case MODE_LOAD:
+			c64.load(j.string.c_str(), j.devicenum);
+			break;
+		case MODE_SAVE:
+			c64.save(j.string.c_str(), j.devicenum);
+			break;
+		case MODE_COMMAND:
+			message = c64.command(j.string.c_str(), j.devicenum);
+			break;
+		case MODE_ERROR_CHANNEL:
+			message = c64.read_error_channel(j.devicenum);
+			break;
+		}
+	}
+	catch (raspbiec_error &e)
+	{
+		status = e.status();
+		message = e.what();
+		if (!message.empty() && message[message.size()-1] == '\n')
+			message.erase(message.size()-1);
+		printf("%s\n", message.c_str());
+		use_own_ids();
+		c64.clear_error(); // Throws when the bus itself is gone
+	}
+	use_own_ids();
+}
+
+const char *daemon_socket_path()
+{
+	const char *path = getenv("RASPBIEC_SOCKET");
+	return (path && *path) ? path : default_socket;
+}
+
+int submit_daemon_job(const char *socket_path, int mode,
+		      const char *string, int devicenum)
+{
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof cwd) == NULL)
+	{
+		fprintf(stderr, "Cannot get the current directory\n");
+		return EXIT_FAILURE;
+	}
+	if (strpbrk(string, "\t\n") != NULL || strpbrk(cwd, "\t\n") != NULL)
+	{
+		fprintf(stderr, "Tabs and newlines cannot be sent to the daemon\n");
+		return EXIT_FAILURE;
+	}
+
+	char devstr[16];
+	snprintf(devstr, sizeof devstr, "%d", devicenum);
+	std::string request = std::string(mode_name(mode)) + "\t" + devstr + "\t" +
+		cwd + "\t" + string + "\n";
+	if (request.size() > max_request)
+	{
+		fprintf(stderr, "The job is too long for the daemon\n");
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_un addr;
+	int fd = socket_address(socket_path, addr);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1)
+	{
+		fprintf(stderr, "Cannot connect to the daemon at '%s'\n", socket_path);
+		if (fd >= 0) close(fd);
+		return EXIT_FAILURE;
+	}
+
+	write_all(fd, request);
+
+	// The reply comes when the job has had its turn
+	std::string reply;
+	std::string fields[2];
+	bool ok = read_line(fd, reply) && split_fields(reply, fields, 2);
+	close(fd);
+	if (!ok)
+	{
+		fprintf(stderr, "No reply from the daemon\n");
+		return EXIT_FAILURE;
+	}
+	printf("%s\n", fields[1].c_str());
+	return (strtol(fields[0].c_str(), NULL, 10) == IEC_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
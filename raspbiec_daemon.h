@@ -0,0 +1,94 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_DAEMON_H
+#define RASPBIEC_DAEMON_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+#include "raspbiec.h"
+
+/* Requests and replies on the control socket are single lines
+ * Request: <load|save|cmd|errch> TAB <device #> TAB <directory> TAB <string>
+ * Reply:   <status> TAB <message>
+ * The status is IEC_OK or the raspbiec_error status of the job.
+ */
+
+// Keeps the bus device open with the computer identity set and runs
+// the jobs sent to its Unix domain socket one at a time, in the order
+// they arrive. The socket is in a directory only the daemon's user
+// can write to, and the group of the bus device may connect to it.
+// Files of a job are accessed with the permissions of its client.
+class raspbiec_daemon
+{
+public:
+	explicit raspbiec_daemon(const char *socket_path);
+	~raspbiec_daemon();
+	void run();
+private:
+	raspbiec_daemon(const raspbiec_daemon &);
+	raspbiec_daemon& operator=(const raspbiec_daemon &);
+
+	struct job
+	{
+		int fd; // Connection the reply goes to
+		uid_t uid; // Client, whose permissions the job has
+		gid_t gid;
+		int mode;
+		int devicenum;
+		std::string dir; // Working directory of the client
+		std::string string;
+	};
+
+	// Connection whose request line has not yet arrived in full
+	struct client
+	{
+		int fd;
+		long long deadline_ms;
+		std::string line;
+	};
+
+	static void *accept_thread(void *arg);
+	void accept_jobs();
+	bool read_client(client &c);
+	bool parse_job(const std::string &line, job &j);
+	void run_job(computer &c64, const job &j, int &status, std::string &message);
+	void reply(int fd, int status, const std::string &message);
+	void shut_down(int status, const char *message);
+
+	std::string m_path;
+	int m_listen;
+	int m_wake[2]; // Write end closed to stop the accept thread
+	bool m_accepting;
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	std::deque<job> m_queue;
+};
+
+// Socket named by RASPBIEC_SOCKET, or the default one
+const char *daemon_socket_path();
+
+// Run a computer job in the daemon and print its result,
+// return EXIT_SUCCESS or EXIT_FAILURE
+int submit_daemon_job(const char *socket_path, int mode,
+		      const char *string, int devicenum);
+
+#endif // RASPBIEC_DAEMON_H
@@ -25,6 +25,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
 
 #if 0
 #define DMSG(format, arg...) do { if (foreground) fprintf(stderr, "[%d]" format "\n", identity, ## arg); } while (0)
@@ -35,10 +37,26 @@
 /* Use format "%c0x%02X" */
 #define ABSHEX(val) ((val)<0)?'-':' ',((val)<0)?-(val):(val)
 
-#define IEC_WAIT_MS 20
 #define IEC_TIMEOUT_MS 10000
+#define PROGRESS_INTERVAL_MS 100
 
-static const struct timespec timeout = { 0, IEC_WAIT_MS * 1000000 };
+// Milliseconds left until deadline, -1 == wait forever
+static long remaining_ms(long long deadline)
+{
+	if (deadline < 0) return -1;
+	long long left = deadline - monotonic_ms();
+	return (left > 0) ? (long)left : 0;
+}
+
+// RASPBIEC_STATS is off, json or, by default, text
+static int stats_mode_from_env(int off, int text, int json)
+{
+	const char *mode = getenv("RASPBIEC_STATS");
+	if (mode == NULL) return text;
+	if (strcmp(mode, "off") == 0) return off;
+	if (strcmp(mode, "json") == 0) return json;
+	return text;
+}
 
 device::device(const bool foreground) :
     		identity(computer),
@@ -47,13 +65,25 @@ device::device(const bool foreground) :
 			data_counter(0),
 			lasterror(IEC_OK),
 			verbose(false),
-			foreground(foreground)
+			foreground(foreground),
+			m_rpos(0),
+			m_rlen(0),
+			m_stats_mode(stats_mode_from_env(stats_off, stats_text, stats_json)),
+			m_transfer_start(0),
+			m_next_progress(0)
 {
 }
 
 device::~device()
 {
-	clear_error();
+	try
+	{
+		clear_error();
+	}
+	catch (raspbiec_error &e)
+	{
+		// The other end of the bus may be gone already
+	}
 }
 
 void device::set_identity(const int new_identity, pipefd &bus)
@@ -65,7 +95,7 @@ void device::set_identity(const int new_identity, pipefd &bus)
 	if (!m_bus.is_open_directional()) throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
 
 
-	bool is_dev (m_bus.read_end() == m_bus.write_end());
+	bool is_dev (m_bus.is_device());
 
 	switch( new_identity )
 	{
@@ -261,6 +291,11 @@ template databuf_back_insert device::load<databuf_back_insert>(
 		const char *const name,
 		int device_number,
 		int secondary_address );
+template datasink_iterator device::load<datasink_iterator>(
+		datasink_iterator load_buf,
+		const char *const name,
+		int device_number,
+		int secondary_address );
 
 // save ram to a device
 databuf_iter device::save(
@@ -269,6 +304,20 @@ databuf_iter device::save(
 		const char *const name,
 		int device_number,
 		int secondary_address )
+{
+	dataspan_list spans(1);
+	spans[0].data = (first == last) ? NULL : &*first;
+	spans[0].len = last - first;
+	dataspan_list_source source(spans);
+	return first + save(source, name, device_number, secondary_address);
+}
+
+// save what the source hands out to a device
+size_t device::save(
+		dataspan_source &source,
+		const char *const name,
+		int device_number,
+		int secondary_address )
 {
 	DMSG("> iec_save");
 	if (device_number == 0 ||
@@ -295,11 +344,11 @@ databuf_iter device::save(
 
 	printf("saving %s\n",name);
 	open_file( name, device_number, 1 );
-	databuf_iter saved = first;
+	size_t saved = 0;
 	verbose = true;
 	try
 	{
-		saved = send_data(first, last, device_number, 1);
+		saved = send_data(source, device_number, 1);
 	}
 	catch (raspbiec_error &e)
 	{
@@ -372,6 +421,30 @@ databuf_iter device::send_data(
 	return sent;
 }
 
+size_t device::send_data(
+		dataspan_source &source,
+		int device_number,
+		int channel )
+{
+	listen( device_number );
+	data_listen( channel );
+
+	size_t sent = 0;
+	try
+	{
+		bool complete;
+		sent = send_to_bus(source, complete);
+	}
+	catch (raspbiec_error &e)
+	{
+		unlisten();
+		throw;
+	}
+	unlisten();
+
+	return sent;
+}
+
 template <class OutputIterator>
 OutputIterator device::receive_data(
 		OutputIterator data_buf,
@@ -397,45 +470,98 @@ OutputIterator device::receive_data(
 }
 
 databuf_iter device::send_to_bus(databuf_iter first, databuf_iter last)
+{
+	dataspan_list spans(1);
+	spans[0].data = (first == last) ? NULL : &*first;
+	spans[0].len = last - first;
+	bool complete;
+	return first + send_to_bus(spans, complete);
+}
+
+size_t device::send_to_bus(const dataspan_list &spans, bool &complete)
+{
+	dataspan_list_source source(spans);
+	return send_to_bus(source, complete);
+}
+
+// Next non-empty span
+static bool next_data(dataspan_source &source, dataspan &span)
+{
+	while (source.next_span(span))
+	{
+		if (span.len > 0) return true;
+	}
+	return false;
+}
+
+size_t device::send_to_bus(dataspan_source &source, bool &complete)
 {
 	int blocks = -1;
 	size_t sent = 0;
-	databuf_iter it = first;
+	complete = true;
+	begin_transfer();
 	try
 	{
 		send_byte_buffered_init();
-		bool aborted = false;
-		for(; it != last; ++it)
+		const size_t chunk = std::min(m_bus.max_transfer(),
+				sizeof m_wbuf / sizeof *m_wbuf);
+
+		// One span of lookahead to know which byte is the last one
+		dataspan cur, next;
+		size_t pos = 0;
+		bool more = next_data(source, cur);
+		bool have_next = more && next_data(source, next);
+		while (more)
 		{
-			int16_t byte = *it;
-			int ret = send_byte_buffered(byte);
-			//fprintf(stderr, "send_byte_buffered %d\n", ret);
-			if (ret == 0 && it != first && identity != computer )
+			// Fill a whole chunk, the last byte of data is preceded by
+			// the EOI marker just like send_last_byte() does it
+			size_t n = 0;
+			bool eoi = false;
+			while (more)
 			{
-				aborted = true;
-				break; // Listened ended data transport
+				bool final = (!have_next && pos + 1 == cur.len);
+				if (n + (final ? 2 : 1) > chunk) break;
+				if (final)
+				{
+					m_wbuf[n++] = IEC_LAST_BYTE_NEXT;
+					eoi = true;
+				}
+				m_wbuf[n++] = cur.data[pos++];
+				if (pos == cur.len)
+				{
+					more = have_next;
+					if (have_next)
+					{
+						cur = next;
+						pos = 0;
+						have_next = next_data(source, next);
+					}
+				}
 			}
-			sent += ret;
-			if (verbose &&
-					(int)(sent/254) > blocks)
+
+			size_t written = send_bytes(m_wbuf, n);
+			if (written < n)
 			{
-				blocks = sent/254;
-				printf("\r%d blocks", blocks);
-				fflush(stdout);
+				// Listener ended data transport, the EOI marker is
+				// not a data byte
+				if (eoi && written == n - 1) --written;
+				sent += written;
+				complete = false;
+				break;
 			}
-		}
-		if (!aborted)
-		{
-			sent += send_last_byte();
+			sent += eoi ? n - 1 : n;
+			show_progress(sent, blocks);
 		}
 	}
 	catch (raspbiec_error &e)
 	{
-		if (verbose && blocks != -1) printf("\r%ld blocks\n",(sent+253)/254);
+		end_progress(sent, blocks);
+		end_transfer(true, sent, false);
 		throw;
 	}
-	if (verbose && blocks != -1) printf("\r%ld blocks\n", (sent+253)/254);
-	return it;
+	end_progress(sent, blocks);
+	end_transfer(true, sent, true); // The listener may end it early
+	return sent;
 }
 
 template <class OutputIterator>
@@ -444,6 +570,7 @@ OutputIterator device::receive_from_bus(OutputIterator data_buf, long timeout_ms
 	int blocks = -1;
 	size_t received = 0;
 	bool last_byte = false;
+	begin_transfer();
 	try
 	{
 	    for (;;)
@@ -465,6 +592,7 @@ OutputIterator device::receive_from_bus(OutputIterator data_buf, long timeout_ms
 			if (IEC_PREV_BYTE_HAS_ERROR == rbyte)
 			{
 				printf("error at byte #0x%04lX\n", received); //..but continue
+				++m_stats.byte_errors;
 			}
 			else if ( rbyte < 0 ) // Some other error
 			{
@@ -474,29 +602,26 @@ OutputIterator device::receive_from_bus(OutputIterator data_buf, long timeout_ms
 			{
 				*data_buf++ = rbyte;
 				++received;
-				if (verbose &&
-						(int)(received/254) > blocks)
-				{
-					blocks = received/254;
-					printf("\r%d blocks", blocks);
-					fflush(stdout);
-				}
+				show_progress(received, blocks);
                 if (last_byte) break;
 			}
 		}
 	}
 	catch (raspbiec_error &e)
 	{
-		if (verbose && blocks != -1) printf("\r%ld blocks\n",(received+253)/254);
+		end_progress(received, blocks);
+		end_transfer(false, received, false);
 		throw;
 	}
-	if (verbose && blocks != -1) printf("\r%ld blocks\n",(received+253)/254);
+	end_progress(received, blocks);
+	end_transfer(false, received, true);
 
 	return data_buf;
 }
 
 //Explicit instantiation
 template databuf_back_insert device::receive_from_bus<databuf_back_insert>(databuf_back_insert data_buf, long timeout_ms);
+template datasink_iterator device::receive_from_bus<datasink_iterator>(datasink_iterator data_buf, long timeout_ms);
 
 
 databuf_iter device::send_to_bus_verbose(databuf_iter first, databuf_iter last)
@@ -507,6 +632,20 @@ databuf_iter device::send_to_bus_verbose(databuf_iter first, databuf_iter last)
 	return r;
 }
 
+size_t device::send_to_bus_verbose(dataspan_source &source, bool &complete)
+{
+	verbose = true;
+	size_t r = send_to_bus(source, complete);
+	verbose = false;
+	return r;
+}
+
+size_t device::send_to_bus_verbose(const dataspan_list &spans, bool &complete)
+{
+	dataspan_list_source source(spans);
+	return send_to_bus_verbose(source, complete);
+}
+
 template <class OutputIterator>
 OutputIterator device::receive_from_bus_verbose(OutputIterator data_buf, long timeout_ms)
 {
@@ -518,6 +657,7 @@ OutputIterator device::receive_from_bus_verbose(OutputIterator data_buf, long ti
 
 //Explicit instantiation
 template databuf_back_insert device::receive_from_bus_verbose<databuf_back_insert>(databuf_back_insert data_buf, long timeout_ms);
+template datasink_iterator device::receive_from_bus_verbose<datasink_iterator>(datasink_iterator data_buf, long timeout_ms);
 
 void device::talk( int device )
 {
@@ -636,6 +776,11 @@ int device::send_last_byte()
 }
 
 int device::send_byte( int16_t byte )
+{
+	return send_bytes(&byte, 1);
+}
+
+size_t device::send_bytes( const int16_t *bytes, size_t count )
 {
 	/* In a tight send loop a second exception may be triggered
 	 * before the first one has been reached a handler ->
@@ -643,18 +788,39 @@ int device::send_byte( int16_t byte )
 	 */
 	//if (lasterror != IEC_OK) return;
 
-	for(long msec = 0; msec < IEC_TIMEOUT_MS; msec+=IEC_WAIT_MS)
+	size_t sent = 0;
+	const long long deadline = monotonic_ms() + IEC_TIMEOUT_MS;
+	for(;;)
 	{
-        DMSG("-> %c0x%02X",ABSHEX(byte));
-		int ret = write(m_bus.write_end(), &byte, sizeof byte);
-		if ( ret == 0 && identity != computer )
+		const long long begin = monotonic_us();
+		++m_stats.waits;
+		int ready = m_bus.wait_bus(true, remaining_ms(deadline));
+		if (ready == 0)
+		{
+			break; // Timeout
+		}
+		else if (ready < 0)
+		{
+			if (errno == EINTR) throw raspbiec_error(IEC_SIGNAL);
+			lasterror = IEC_GENERAL_ERROR;
+			throw raspbiec_error(IEC_GENERAL_ERROR);
+		}
+
+        DMSG("-> %c0x%02X (%ld)",ABSHEX(bytes[sent]),(long)(count-sent));
+		ssize_t ret = m_bus.write_bus(bytes + sent, count - sent);
+		++m_stats.writes;
+		if (ret > 0) m_stats.add_handshake(monotonic_us() - begin, ret);
+		if ( ret >= 0 && identity != computer )
 		{
-			// Listener ended data transport
-			return 0;
+			// A short write means that the listener
+			// ended data transport
+			return sent + ret;
 		}
 		else if ( ret > 0 ) // Normal write
 		{
-			return 1;
+			sent += ret;
+			if (sent == count) return sent;
+			++m_stats.retries; // Write the rest when there is room
 		}
 		else if (ret < 0)
 		{
@@ -672,26 +838,49 @@ int device::send_byte( int16_t byte )
 				throw raspbiec_error(IEC_GENERAL_ERROR);
 			}
 		}
-		nanosleep(&timeout, NULL);
+		else // Nothing written, try again
+		{
+			++m_stats.retries;
+		}
 	}
 	throw raspbiec_error(IEC_READ_TIMEOUT);
 }
 
 int16_t device::receive_byte(long timeout_ms)
 {
-	// Note:  timeout will work only if fd_read is in non-blocking mode
 	if (timeout_ms == timeout_default) timeout_ms = IEC_TIMEOUT_MS;
 
-	long msec = 0;
-	for(;;)
+	const long long deadline =
+			(timeout_ms == timeout_infinite) ? -1 : monotonic_ms() + timeout_ms;
+	while (m_rpos == m_rlen)
 	{
-		int16_t readbyte;
-		int ret = read(m_bus.read_end(), &readbyte, sizeof readbyte);
+		// Sleep until the bus has data or the deadline passes
+		const long long begin = monotonic_us();
+		++m_stats.waits;
+		int ready = m_bus.wait_bus(false, remaining_ms(deadline));
+		if (ready == 0)
+		{
+			throw raspbiec_error(IEC_WRITE_TIMEOUT);
+		}
+		else if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				DMSG("EINTR");
+				throw raspbiec_error(IEC_SIGNAL);
+			}
+			lasterror = IEC_GENERAL_ERROR;
+			throw raspbiec_error(IEC_GENERAL_ERROR);
+		}
+
+		// Drain everything that is available with one read
+		ssize_t ret = m_bus.read_bus(m_rbuf, RASPBIEC_READ_FIFO_SIZE);
+		++m_stats.reads;
 		if (ret > 0)
 		{
-			if (readbyte < 0) lasterror = readbyte;
-            DMSG("<- %c0x%02X",ABSHEX(readbyte));
-			return readbyte;
+			m_stats.add_handshake(monotonic_us() - begin, ret);
+			m_rpos = 0;
+			m_rlen = ret;
 		}
 		else if (ret < 0)
 		{
@@ -720,14 +909,12 @@ int16_t device::receive_byte(long timeout_ms)
 		{
 			throw raspbiec_error(IEC_SIGNAL);
 		}
-		if (timeout_ms != timeout_infinite)
-		{
-			if (msec >= timeout_ms) break;
-			msec+=IEC_WAIT_MS;
-		}
-		nanosleep(&timeout, NULL);
 	}
-	throw raspbiec_error(IEC_WRITE_TIMEOUT);
+
+	int16_t readbyte = m_rbuf[m_rpos++];
+	if (readbyte < 0) lasterror = readbyte;
+	DMSG("<- %c0x%02X",ABSHEX(readbyte));
+	return readbyte;
 }
 
 void device::clear_error(void)
@@ -735,3 +922,151 @@ void device::clear_error(void)
 	send_byte(IEC_CLEAR_ERROR);
 	lasterror = IEC_OK;
 }
+
+void device::begin_transfer()
+{
+	m_stats.clear();
+	m_transfer_start = monotonic_us();
+	m_next_progress = 0;
+}
+
+void device::end_transfer(bool sending, size_t bytes, bool ok)
+{
+	const char *direction = sending ? "send" : "receive";
+	m_stats.transfers = 1;
+	m_stats.failed = ok ? 0 : 1;
+	m_stats.bytes = bytes;
+	m_stats.us = monotonic_us() - m_transfer_start;
+	(sending ? m_sent : m_received).add(m_stats);
+	if (!verbose) return; // Only file transfers are reported
+	if (m_stats_mode == stats_text)
+	{
+		m_stats.print(stdout, direction);
+	}
+	else if (m_stats_mode == stats_json)
+	{
+		m_stats.print_json(stderr, direction);
+	}
+}
+
+// Printing on every block would cost a terminal write per 254 bytes
+void device::show_progress(size_t bytes, int &blocks)
+{
+	if (!verbose || (int)(bytes/254) <= blocks) return;
+	blocks = bytes/254;
+	long long now = monotonic_ms();
+	if (now >= m_next_progress)
+	{
+		printf("\r%d blocks", blocks);
+		fflush(stdout);
+		m_next_progress = now + PROGRESS_INTERVAL_MS;
+	}
+}
+
+void device::end_progress(size_t bytes, int blocks)
+{
+	if (verbose && blocks != -1) printf("\r%ld blocks\n", (bytes+253)/254);
+}
+
+/*********************************************************************/
+
+void transfer_stats::clear()
+{
+	transfers = 0;
+	failed = 0;
+	bytes = 0;
+	us = 0;
+	reads = 0;
+	writes = 0;
+	waits = 0;
+	retries = 0;
+	byte_errors = 0;
+	std::fill(handshake_hist, handshake_hist + hist_buckets, 0);
+	std::fill(byte_hist, byte_hist + hist_buckets, 0);
+}
+
+static int hist_bucket(long long us)
+{
+	int bucket = 0;
+	while (us > 0 && bucket < transfer_stats::hist_buckets - 1)
+	{
+		us >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+void transfer_stats::add_handshake(long long us, size_t entries)
+{
+	++handshake_hist[hist_bucket(us)];
+	byte_hist[hist_bucket(us / entries)] += entries;
+}
+
+void transfer_stats::add(const transfer_stats &other)
+{
+	transfers += other.transfers;
+	failed += other.failed;
+	bytes += other.bytes;
+	us += other.us;
+	reads += other.reads;
+	writes += other.writes;
+	waits += other.waits;
+	retries += other.retries;
+	byte_errors += other.byte_errors;
+	for (int i = 0; i < hist_buckets; ++i)
+	{
+		handshake_hist[i] += other.handshake_hist[i];
+		byte_hist[i] += other.byte_hist[i];
+	}
+}
+
+// Upper bound in us of the bucket holding the given fraction of counts
+static unsigned long long hist_percentile(const unsigned long *hist, double fraction)
+{
+	unsigned long long total = 0;
+	for (int i = 0; i < transfer_stats::hist_buckets; ++i) total += hist[i];
+	unsigned long long seen = 0;
+	for (int i = 0; i < transfer_stats::hist_buckets; ++i)
+	{
+		seen += hist[i];
+		if (seen > 0 && seen >= fraction * total) return 1ULL << i;
+	}
+	return 0;
+}
+
+void transfer_stats::print(FILE *out, const char *direction) const
+{
+	double secs = us / 1e6;
+	fprintf(out, "%s %llu bytes in %.3f s, %.0f bytes/s, "
+		"%llu reads, %llu writes, %llu waits, %llu retries, %llu byte errors, "
+		"handshake p50 <%llu us p99 <%llu us\n",
+		direction, bytes, secs, (secs > 0) ? bytes / secs : 0.0,
+		reads, writes, waits, retries, byte_errors,
+		hist_percentile(handshake_hist, 0.5), hist_percentile(handshake_hist, 0.99));
+}
+
+static void print_json_hist(FILE *out, const char *name, const unsigned long *hist)
+{
+	int used = transfer_stats::hist_buckets;
+	while (used > 0 && hist[used-1] == 0) --used;
+	fprintf(out, ",\"%s\":[", name);
+	for (int i = 0; i < used; ++i)
+	{
+		fprintf(out, "%s%lu", i ? "," : "", hist[i]);
+	}
+	fprintf(out, "]");
+}
+
+// One object per line, histogram bucket n is [2^(n-1), 2^n) us
+void transfer_stats::print_json(FILE *out, const char *direction) const
+{
+	fprintf(out, "{\"direction\":\"%s\",\"ok\":%s,\"bytes\":%llu,\"us\":%llu,"
+		"\"bytes_per_s\":%.0f,\"reads\":%llu,\"writes\":%llu,\"waits\":%llu,"
+		"\"retries\":%llu,\"byte_errors\":%llu",
+		direction, failed ? "false" : "true", bytes, us,
+		us ? bytes * 1e6 / us : 0.0, reads, writes, waits, retries, byte_errors);
+	print_json_hist(out, "handshake_us_hist", handshake_hist);
+	print_json_hist(out, "byte_us_hist", byte_hist);
+	fprintf(out, "}\n");
+	fflush(out);
+}
@@ -20,12 +20,41 @@
 #define RASPBIEC_DEVICE_H
 
 #include <cstddef>
+#include <cstdio>
 #include <stdint.h>
 #include <vector>
 #include <iterator>
 #include "raspbiec_common.h"
 #include "raspbiec_types.h"
 #include "raspbiec_utils.h"
+#include "raspbiec_transport.h"
+
+// Counters and timings of bus transfers. A handshake is one wait for
+// the bus plus the read or write that follows it; its time divided by
+// the entries moved gives the per byte latency.
+struct transfer_stats
+{
+	enum { hist_buckets = 24 }; // Bucket n counts times of [2^(n-1), 2^n) us
+
+	transfer_stats() { clear(); }
+	void clear();
+	void add_handshake(long long us, size_t entries);
+	void add(const transfer_stats &other);
+	void print(FILE *out, const char *direction) const;
+	void print_json(FILE *out, const char *direction) const;
+
+	unsigned long transfers;
+	unsigned long failed;
+	unsigned long long bytes;
+	unsigned long long us;        // Time spent in transfers
+	unsigned long long reads;     // Bus reads, syscalls on the device node
+	unsigned long long writes;    // Bus writes
+	unsigned long long waits;     // Waits for the bus to become ready
+	unsigned long long retries;   // Writes which did not take everything
+	unsigned long long byte_errors; // IEC_PREV_BYTE_HAS_ERROR received
+	unsigned long handshake_hist[hist_buckets];
+	unsigned long byte_hist[hist_buckets];
+};
 
 class device
 {
@@ -77,6 +106,12 @@ public:
 			const char *const name,
 			int device_number,
 			int secondary_address );
+    // Return # of bytes saved
+    size_t save(
+    		dataspan_source &source,
+			const char *const name,
+			int device_number,
+			int secondary_address );
 
     void open_file( const char *name, int device, int secondary_address );
     void close_file(int device, int secondary_address);
@@ -86,6 +121,10 @@ public:
 			databuf_iter last,
 		     int device_number,
 		     int channel );
+    size_t send_data(
+    		dataspan_source &source,
+			int device_number,
+			int channel );
 
     template <class OutputIterator>
     OutputIterator receive_data(
@@ -101,6 +140,13 @@ public:
     // Common routines
     databuf_iter send_to_bus(databuf_iter first, databuf_iter last);
     databuf_iter send_to_bus_verbose (databuf_iter first, databuf_iter last);
+    // Send everything the source hands out, the last byte with EOI.
+    // Return # of bytes sent, complete is false if the listener
+    // ended the transfer before the end of data.
+    size_t send_to_bus(dataspan_source &source, bool &complete);
+    size_t send_to_bus_verbose(dataspan_source &source, bool &complete);
+    size_t send_to_bus(const dataspan_list &spans, bool &complete);
+    size_t send_to_bus_verbose(const dataspan_list &spans, bool &complete);
     template <class OutputIterator>
     OutputIterator receive_from_bus(OutputIterator data_buf, long timeout_ms = timeout_default);
     template <class OutputIterator>
@@ -120,8 +166,15 @@ public:
     int send_byte_buffered( int16_t byte );
     int send_last_byte();
     int send_byte( int16_t byte );
+    // Send a batch of bytes/control codes with one bus write
+    // Return # of entries actually sent to bus
+    size_t send_bytes( const int16_t *bytes, size_t count );
     int16_t receive_byte( long timeout_ms = timeout_default );
     void clear_error(void);
+    // Statistics of the latest transfer and of all transfers each way
+    const transfer_stats &last_transfer() const { return m_stats; }
+    const transfer_stats &all_sent() const { return m_sent; }
+    const transfer_stats &all_received() const { return m_received; }
 
 private:
     int identity;
@@ -132,6 +185,23 @@ private:
     int16_t lasterror;
     bool verbose;
     bool foreground;
+    // Batched bus transfers
+    int16_t m_wbuf[RASPBIEC_WRITE_FIFO_SIZE];
+    int16_t m_rbuf[RASPBIEC_READ_FIFO_SIZE];
+    size_t m_rpos;
+    size_t m_rlen;
+    // Instrumentation
+    enum { stats_off, stats_text, stats_json };
+    void begin_transfer();
+    void end_transfer(bool sending, size_t bytes, bool ok);
+    void show_progress(size_t bytes, int &blocks);
+    void end_progress(size_t bytes, int blocks);
+    int m_stats_mode;
+    long long m_transfer_start;
+    long long m_next_progress;
+    transfer_stats m_stats;
+    transfer_stats m_sent;
+    transfer_stats m_received;
 };
 
 #endif // RASPBIEC_DEVICE_H
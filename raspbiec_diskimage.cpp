@@ -16,8 +16,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <cstdio>
 #include <cstddef>
+#include <algorithm>
 #include "raspbiec_diskimage.h"
 #include "raspbiec_exception.h"
 #include "raspbiec_common.h"
@@ -187,16 +193,6 @@ struct Dataentry
         1E-1F: File size in sectors, low/high byte  order  ($1E+$1F*256).
                The approx. filesize in bytes is <= #sectors * 254
 */
-enum Filetype
-{
-	FILE_DEL       = 0x0,
-	FILE_SEQ       = 0x1,
-	FILE_PRG       = 0x2,
-	FILE_USR       = 0x3,
-	FILE_REL       = 0x4,
-	FILE_LOCKED = 1<<6,
-	FILE_CLOSED = 1<<7,
-};
 
 
 
@@ -228,16 +224,32 @@ size_t Diskimage::block_offset(int track, int sector)
 }
 
 Diskimage::Diskimage() :
+		m_fd(-1),
+		m_image(NULL),
+		m_image_size(0),
 		m_disktype(-1),
 		m_disk_block(NULL),
 		m_dirty(false),
-		m_mounted(false)
+		m_generation(0),
+		m_written(false),
+		m_mounted(false),
+		m_blocks_free(0)
 {
+	std::fill(m_free_mask, m_free_mask + max_tracks + 1, 0);
+	std::fill(m_hash_head, m_hash_head + dir_hash_size, -1);
+	std::fill(m_prefix_head, m_prefix_head + 256, -1);
 }
 
 Diskimage::~Diskimage()
 {
-	close();
+	try
+	{
+		close();
+	}
+	catch (raspbiec_error &e)
+	{
+		// Already reported
+	}
 }
 
 void Diskimage::open(const char *path)
@@ -245,67 +257,221 @@ void Diskimage::open(const char *path)
 	close();
 	m_disktype = -1;
 	m_imagename = path;
-	read_local_file(m_image, m_imagename.c_str());
+
+	m_fd = ::open(path, O_RDWR);
+	if (m_fd < 0 && (errno == EACCES || errno == EROFS))
+	{
+		m_fd = ::open(path, O_RDONLY); // Writes fail on flush()
+	}
+	if (m_fd < 0)
+	{
+		fprintf(stderr,"Could not open local file '%s'\n",path);
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+
+	struct stat sb;
+	if (fstat(m_fd, &sb) == -1)
+	{
+		fprintf(stderr,"Could not get size of file '%s'\n",path);
+		::close(m_fd);
+		m_fd = -1;
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+
 	for (unsigned int i=0; i<COUNT_OF(diskinfo); ++i)
 	{
-		if (m_image.size() == diskinfo[i].image_size)
+		if ((size_t)sb.st_size == diskinfo[i].image_size)
 		{
 			m_disktype = i;
-			m_mounted = true;
-			// Cache a pointer to BAM etc.
-			m_disk_block =
-					(Diskentry *)block(diskinfo[m_disktype].bam_track, diskinfo[m_disktype].bam_sector);
 			break;
 		}
 	}
-
-	if (!m_mounted)
+	if (m_disktype < 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
 		throw raspbiec_error(IEC_UNKNOWN_DISK_IMAGE);
+	}
+
+	void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr,"Could not map file '%s'\n",path);
+		::close(m_fd);
+		m_fd = -1;
+		throw raspbiec_error(IEC_DISK_IMAGE_ERROR);
+	}
+	m_image = (unsigned char *)map;
+	m_image_size = sb.st_size;
+	m_dirty_blocks.assign(m_image_size / 0x100, false);
+	m_mounted = true;
+	++m_generation;
+	// Cache a pointer to BAM etc.
+	m_disk_block =
+			(Diskentry *)block(diskinfo[m_disktype].bam_track, diskinfo[m_disktype].bam_sector);
+	decode_bam();
+	build_index();
 }
 
 void Diskimage::close()
 {
 	if (m_mounted)
 	{
-		flush();
-		m_image.clear();
-		m_imagename.clear();
 		m_mounted = false;
+		bool synced = true;
+		try
+		{
+			flush();
+		}
+		catch (raspbiec_error &e)
+		{
+			synced = false;
+		}
+		if (m_written && fsync(m_fd) == -1)
+		{
+			fprintf(stderr,"Could not sync '%s'\n",m_imagename.c_str());
+			synced = false;
+		}
+		munmap(m_image, m_image_size);
+		::close(m_fd);
+		m_fd = -1;
+		m_image = NULL;
+		m_image_size = 0;
+		m_disk_block = NULL;
+		m_dirty = false;
+		m_dirty_blocks.clear();
+		m_slots.clear();
+		m_dirblock_slot.clear();
+		m_files.clear();
+		m_written = false;
+		m_imagename.clear();
+		if (!synced)
+			throw raspbiec_error(IEC_FILE_WRITE_ERROR);
 	}
 }
 
+// Write the changed blocks back, consecutive ones with a single pwrite()
 void Diskimage::flush()
 {
-	if (m_dirty)
+	if (!m_dirty)
+		return;
+
+	size_t blocks = m_dirty_blocks.size();
+	size_t first = 0;
+	while (first < blocks)
 	{
-		write_local_file(m_image, m_imagename.c_str());
+		if (!m_dirty_blocks[first])
+		{
+			++first;
+			continue;
+		}
+		size_t end = first + 1;
+		while (end < blocks && m_dirty_blocks[end]) ++end;
+
+		size_t offset = first * 0x100;
+		size_t len = (end - first) * 0x100;
+		while (len > 0)
+		{
+			ssize_t wr = pwrite(m_fd, m_image + offset, len, offset);
+			if (wr < 0 && errno == EINTR)
+				continue;
+			if (wr <= 0)
+			{
+				fprintf(stderr,"Could not write to '%s'\n",m_imagename.c_str());
+				throw raspbiec_error(IEC_FILE_WRITE_ERROR);
+			}
+			offset += wr;
+			len -= wr;
+		}
+		m_written = true;
+		std::fill(m_dirty_blocks.begin() + first, m_dirty_blocks.begin() + end, false);
+		first = end;
+	}
+	m_dirty = false;
+}
+
+void Diskimage::layout(image_layout &tracks)
+{
+	tracks.clear();
+	if (!m_mounted)
+		return;
+	tracks.resize(diskinfo[m_disktype].last_track + 1);
+	for (int t = diskinfo[m_disktype].first_track; t <= diskinfo[m_disktype].last_track; ++t)
+	{
+		tracks[t].first_block = trackinfo[t].track_offset;
+		tracks[t].sectors = trackinfo[t].sectors_per_track;
 	}
 }
 
 unsigned char *Diskimage::block(int track, int sector)
 {
 	size_t offset = block_offset(track, sector);
-	if (offset >= m_image.size())
+	if (offset >= m_image_size)
 		throw raspbiec_error(IEC_ILLEGAL_TRACK_SECTOR);
 
-	return m_image.data() + offset;
+	return m_image + offset;
 }
 
-static bool match_name(
-		std::vector<unsigned char>& petsciiname,
-		unsigned char* dirname)
+unsigned char *Diskimage::modify_block(int track, int sector)
+{
+	unsigned char *b = block(track, sector);
+	set_dirty(b);
+	return b;
+}
+
+// Mark the block containing p changed
+void Diskimage::set_dirty(const void *p)
+{
+	m_dirty_blocks[((const unsigned char *)p - m_image) / 0x100] = true;
+	m_dirty = true;
+	++m_generation;
+}
+
+// http://sta.c64.org/cbm64pet.html
+// "Codes $60-$7F and $E0-$FE are not used. Although you can print them, these are, actually, copies of codes $C0-$DF and $A0-$BE"
+static inline unsigned char normalise_petscii(unsigned char c)
+{
+	if (c >= 0x60 && c <= 0x7F) return c + 0x60;
+	if (c >= 0xE0 && c <= 0xFE) return c - 0x40;
+	return c;
+}
+
+// Name in a direntry, up to the shift-space end marker
+static int normalise_dirname(const unsigned char *dirname, unsigned char *key)
+{
+	int len = 0;
+	for (; len < 16 && dirname[len] != 0xA0; ++len)
+	{
+		key[len] = normalise_petscii(dirname[len]);
+	}
+	std::fill(key + len, key + 16, 0xA0);
+	return len;
+}
+
+static unsigned int hash_name(const unsigned char *key, int keylen)
 {
-	for (unsigned int j=0; j < 16; ++j)
+	unsigned int h = 2166136261u; // FNV-1a
+	for (int i = 0; i < keylen; ++i)
 	{
-		unsigned char c = dirname[j];
+		h = (h ^ key[i]) * 16777619u;
+	}
+	return h;
+}
 
-		if (c == 0xA0) // shift-space (name end marker)
-			return (j == petsciiname.size());
+// Does a normalised pattern match a normalised name
+static bool match_name(
+		const std::vector<unsigned char>& pattern,
+		const unsigned char* key, int keylen)
+{
+	for (int j=0; j < 16; ++j)
+	{
+		if (j == keylen) // name end
+			return ((size_t)j == pattern.size());
 
-		if (j >= petsciiname.size())
+		if ((size_t)j >= pattern.size())
 			return false;
 
-		unsigned char cs = petsciiname[j];
+		unsigned char cs = pattern[j];
 
 		if (cs == 0x2A) // '*'
 			return true;
@@ -313,34 +479,52 @@ static bool match_name(
 		if (cs == 0x3F) // '?'
 			continue;
 
-        // http://sta.c64.org/cbm64pet.html
-        // "Codes $60-$7F and $E0-$FE are not used. Although you can print them, these are, actually, copies of codes $C0-$DF and $A0-$BE"
-        if (c  >= 0x60 && c  <= 0x7F) c  += 0x60;
-        if (c  >= 0xE0 && c  <= 0xFE) c  -= 0x40;
-        if (cs >= 0x60 && cs <= 0x7F) cs += 0x60;
-        if (cs >= 0xE0 && cs <= 0xFE) cs -= 0x40;
-
-		if (c != cs)
+		if (key[j] != cs)
 			return false;
 	}
 	return true;
 }
 
-int Diskimage::blocks_free()
+unsigned char Diskimage::normalise(unsigned char petschar)
+{
+	return normalise_petscii(petschar);
+}
+
+bool Diskimage::name_matches(const std::vector<unsigned char>& pattern,
+			     const unsigned char *key, int keylen)
+{
+	return match_name(pattern, key, keylen);
+}
+
+// Blocks on the directory track(s) are not shown as free
+bool Diskimage::counts_as_free(int track)
+{
+	return diskinfo[m_disktype].data_to_dir_track ||
+			(track != diskinfo[m_disktype].dir_track &&
+			 track != diskinfo[m_disktype].dir_track2);
+}
+
+void Diskimage::decode_bam()
 {
 	BAMentry *be = (BAMentry *)m_disk_block->BAM;
 
-	int free = 0;
+	std::fill(m_free_mask, m_free_mask + max_tracks + 1, 0);
+	m_blocks_free = 0;
 	for (int track = diskinfo[m_disktype].first_track; track <= diskinfo[m_disktype].last_track; ++track)
 	{
-		if (diskinfo[m_disktype].data_to_dir_track ||
-				(track != diskinfo[m_disktype].dir_track &&
-						track != diskinfo[m_disktype].dir_track2))
+		const unsigned char *bm = be[track-1].bitmap;
+		m_free_mask[track] = (bm[0] | (bm[1] << 8) | (bm[2] << 16)) &
+				((1u << trackinfo[track].sectors_per_track) - 1);
+		if (counts_as_free(track))
 		{
-			free += be[track - diskinfo[m_disktype].first_track].free;
+			m_blocks_free += be[track-1].free;
 		}
 	}
-	return free;
+}
+
+int Diskimage::blocks_free()
+{
+	return m_blocks_free;
 }
 
 bool Diskimage::block_is_allocated(int track, int sector)
@@ -348,9 +532,7 @@ bool Diskimage::block_is_allocated(int track, int sector)
 	if (!valid_ts(track, sector))
 		return true;
 
-	BAMentry *be = (BAMentry *)m_disk_block->BAM;
-
-	return !(be[track-1].bitmap[sector/8] & (1 << (sector & 7)));
+	return !(m_free_mask[track] & (1u << sector));
 }
 
 void Diskimage::set_block_allocation(int track, int sector, bool alloc)
@@ -366,17 +548,28 @@ void Diskimage::set_block_allocation(int track, int sector, bool alloc)
 	unsigned char* bp = &be[track-1].bitmap[sector/8];
 	unsigned char bm = 1 << (sector & 7); // Bitmask for the bit
 
-	bool BAM_alloc = !(*bp & bm);
+	bool BAM_alloc = !(m_free_mask[track] & (1u << sector));
+	int change = 0;
 
 	if (alloc && !BAM_alloc)
 	{
 		*bp &= ~bm; // Allocate a free block - clear bit
 		--be[track-1].free;
+		m_free_mask[track] &= ~(1u << sector);
+		change = -1;
 	}
 	else if (!alloc && BAM_alloc)
 	{
 		*bp |= bm; // Free an allocated block - set bit
 		++be[track-1].free;
+		m_free_mask[track] |= 1u << sector;
+		change = 1;
+	}
+
+	if (change != 0)
+	{
+		if (counts_as_free(track)) m_blocks_free += change;
+		set_dirty(m_disk_block);
 	}
 }
 
@@ -430,11 +623,8 @@ bool Diskimage::find_first_free_block(int& track, int& sector)
 
 	if (found)
 	{
-		for (sector = 0; sector < trackinfo[track].sectors_per_track; ++sector)
-		{
-			found = !block_is_allocated(track, sector);
-			if (found) break;
-		}
+		found = (m_free_mask[track] != 0);
+		if (found) sector = __builtin_ctz(m_free_mask[track]);
 	}
 
 	return found;
@@ -457,7 +647,7 @@ bool Diskimage::find_next_free_block(int& track, int& sector, int interleave)
 
 	while (!found && tries > 0)
 	{
-		if (!track_is_full(track))
+		if (!track_is_full(track) && m_free_mask[track] != 0)
 		{
 			if (track == cur_track || !diskinfo[m_disktype].geos_disk)
 			{
@@ -474,13 +664,15 @@ bool Diskimage::find_next_free_block(int& track, int& sector, int interleave)
 				sector -= sectors_per_track;
 				if (sector > 0 && !diskinfo[m_disktype].geos_disk) --sector;
 			}
-			int cur_sector = sector;
-			do
+			// First free sector at or after this one, wrapping around
+			uint32_t mask = m_free_mask[track];
+			if (mask != 0)
 			{
-				found = !block_is_allocated(track, sector);
-				if (!found) ++sector;
-				if (sector >= sectors_per_track) sector = 0;
-			} while (!found && sector != cur_sector);
+				uint32_t rotated = (mask >> sector);
+				if (sector > 0) rotated |= mask << (sectors_per_track - sector);
+				sector = (sector + __builtin_ctz(rotated)) % sectors_per_track;
+				found = true;
+			}
 		}
 		else // track full, try another
 		{
@@ -551,93 +743,249 @@ Diskimage::Direntry_state::Direntry_state(int track, int sector, int entry) :
 {
 }
 
-Diskimage::Direntry* Diskimage::find_matching_direntry(
-		bool (*matcher)(Diskimage::Direntry *d, int entry_index, void *userdata),
-		void *userdata,
-		Direntry_state *de_state )
+void Diskimage::build_index()
 {
-	Direntry *found = NULL;
+	m_slots.clear();
+	m_dirblock_slot.assign(m_dirty_blocks.size(), -1);
+	std::fill(m_hash_head, m_hash_head + dir_hash_size, -1);
+	std::fill(m_prefix_head, m_prefix_head + 256, -1);
+
+	int track  = diskinfo[m_disktype].dir_track;
+	int sector = diskinfo[m_disktype].dir_sector;
+	// Bounded in case of a looping directory chain
+	for (size_t blocks = 0; track != 0 && blocks < m_dirty_blocks.size(); ++blocks)
+	{
+		add_dirblock(track, sector);
+		Direntry *dir_block = m_slots.back().entry - 7;
+		track  = dir_block[0].link_track;
+		sector = dir_block[0].link_sector;
+	}
+}
+
+// Append the entries of a directory block to the index
+void Diskimage::add_dirblock(int track, int sector)
+{
+	Direntry *dir_block = (Direntry *)block(track, sector);
+	m_dirblock_slot[block_number(track, sector)] = m_slots.size();
+	for (int i = 0; i < 8; ++i)
+	{
+		Dirslot ds;
+		ds.entry = &dir_block[i];
+		ds.track = track;
+		ds.sector = sector;
+		ds.keylen = 0;
+		ds.indexed = false;
+		ds.hash_next = -1;
+		ds.prefix_next = -1;
+		m_slots.push_back(ds);
+		index_slot(m_slots.size() - 1);
+	}
+}
+
+// Add a slot to the hash and prefix chains, unless it is scratched.
+// Chains are kept in directory order so that the first match wins.
+void Diskimage::index_slot(int slot)
+{
+	Dirslot &ds = m_slots[slot];
+	if (ds.entry->filetype == FILE_DEL)
+		return;
+
+	ds.keylen = normalise_dirname(ds.entry->name, ds.key);
+	ds.indexed = true;
 
-	Direntry_state des;
+	int *link = &m_hash_head[hash_name(ds.key, ds.keylen) & (dir_hash_size-1)];
+	while (*link >= 0 && *link < slot) link = &m_slots[*link].hash_next;
+	ds.hash_next = *link;
+	*link = slot;
 
-	if (de_state == NULL || de_state->track == 0)
+	if (ds.keylen > 0)
 	{
-		// Start from the beginning
-		des.track  = diskinfo[m_disktype].dir_track;
-		des.sector = diskinfo[m_disktype].dir_sector;
-		des.entry  = 0;
+		link = &m_prefix_head[ds.key[0]];
+		while (*link >= 0 && *link < slot) link = &m_slots[*link].prefix_next;
+		ds.prefix_next = *link;
+		*link = slot;
 	}
-	else // continue with processing
+}
+
+// The stored key leads to the one hash bucket and prefix chain
+// the slot can be in
+void Diskimage::unindex_slot(int slot)
+{
+	Dirslot &ds = m_slots[slot];
+	if (!ds.indexed)
+		return;
+
+	int *l = &m_hash_head[hash_name(ds.key, ds.keylen) & (dir_hash_size-1)];
+	while (*l >= 0 && *l != slot) l = &m_slots[*l].hash_next;
+	if (*l == slot) *l = ds.hash_next;
+	if (ds.keylen > 0)
 	{
-		des = *de_state;
+		l = &m_prefix_head[ds.key[0]];
+		while (*l >= 0 && *l != slot) l = &m_slots[*l].prefix_next;
+		if (*l == slot) *l = ds.prefix_next;
 	}
+	ds.hash_next = -1;
+	ds.prefix_next = -1;
+	ds.keylen = 0;
+	ds.indexed = false;
+}
 
-	Direntry *dir_block = NULL;
-	do
+// Directory blocks hold 8 entries of 32 bytes each
+int Diskimage::slot_of(const Direntry *d)
+{
+	size_t offset = (const unsigned char *)d - m_image;
+	int first = m_dirblock_slot[offset / 0x100];
+	if (first < 0)
+		return -1;
+	return first + (offset % 0x100) / sizeof(Direntry);
+}
+
+Diskimage::Direntry* Diskimage::find_direntry(const std::vector<unsigned char>& petsciiname)
+{
+	std::vector<unsigned char> pattern(petsciiname.size());
+	std::transform(petsciiname.begin(), petsciiname.end(), pattern.begin(), normalise_petscii);
+
+	// Only the first 16 characters count
+	size_t len = std::min(pattern.size(), (size_t)16);
+	size_t prefix = 0;
+	while (prefix < len && pattern[prefix] != 0x2A && pattern[prefix] != 0x3F) ++prefix;
+
+	if (prefix == len) // No wildcards, exact name
 	{
-		dir_block = (Direntry *)block(des.track, des.sector);
-		for (; des.entry < 8 && !found; ++des.entry)
+		int slot = m_hash_head[hash_name(pattern.data(), len) & (dir_hash_size-1)];
+		for (; slot >= 0; slot = m_slots[slot].hash_next)
 		{
-			if (matcher(&dir_block[des.entry], des.entry, userdata))
-			{
-				found = &dir_block[des.entry];
-			}
+			const Dirslot &ds = m_slots[slot];
+			if ((size_t)ds.keylen == len && std::equal(ds.key, ds.key + len, pattern.begin()))
+				return ds.entry;
 		}
-		// Get next dir block if it exists
-		if (des.entry >= 8 && dir_block[0].link_track != 0)
+		return NULL;
+	}
+
+	if (prefix > 0) // Only names with the same first character can match
+	{
+		for (int slot = m_prefix_head[pattern[0]]; slot >= 0; slot = m_slots[slot].prefix_next)
 		{
-			des.track  = dir_block[0].link_track;
-			des.sector = dir_block[0].link_sector;
-			des.entry = 0;
+			const Dirslot &ds = m_slots[slot];
+			if (match_name(pattern, ds.key, ds.keylen))
+				return ds.entry;
 		}
+		return NULL;
 	}
-	while (des.entry < 8 && !found);
-
-	// Exit state: next direntry to be processed
-	// Search exhausted when des.entry == 8
-	if (de_state) *de_state = des;
 
-	return found;
+	for (size_t slot = 0; slot < m_slots.size(); ++slot)
+	{
+		const Dirslot &ds = m_slots[slot];
+		if (ds.entry->filetype != FILE_DEL && match_name(pattern, ds.key, ds.keylen))
+			return ds.entry;
+	}
+	return NULL;
 }
 
-static bool direntry_free_slot_matcher(Diskimage::Direntry *d, int, void *)
+Diskimage::Dirfilter::Dirfilter() :
+		m_filetype(-1)
 {
-	if (!d)
-		return false;
+}
 
-	if (d->filetype == FILE_DEL)
-		return true;
+// The drive number and the colon are optional, each pattern may
+// end with "=type" which then applies to the whole listing
+Diskimage::Dirfilter::Dirfilter(const std::vector<unsigned char>& petsciiname) :
+		m_filetype(-1)
+{
+	std::vector<unsigned char>::const_iterator it = petsciiname.begin();
+	if (it != petsciiname.end() && *it == 0x24) ++it; // '$'
+	while (it != petsciiname.end() && *it >= 0x30 && *it <= 0x39) ++it;
+	if (it == petsciiname.end() || *it != 0x3A) // ':'
+		return;
+	++it;
 
-	return false;
+	std::vector<unsigned char> pattern;
+	for (;; ++it)
+	{
+		if (it == petsciiname.end() || *it == 0x2C) // ','
+		{
+			if (!pattern.empty())
+				m_patterns.push_back(pattern);
+			pattern.clear();
+			if (it == petsciiname.end())
+				break;
+		}
+		else if (*it == 0x3D) // '='
+		{
+			if (++it == petsciiname.end())
+				break;
+			m_filetype = filetype_of(*it);
+			while (it + 1 != petsciiname.end() && *(it + 1) != 0x2C) ++it;
+		}
+		else
+		{
+			pattern.push_back(normalise_petscii(*it));
+		}
+	}
 }
 
-static bool direntry_name_matcher(Diskimage::Direntry *d, int, void *name)
+int Diskimage::Dirfilter::filetype_of(unsigned char letter)
 {
-	if (!d)
-		return false;
+	letter = normalise_petscii(letter);
+	if (letter >= 0xC1 && letter <= 0xDA) letter -= 0x80;
+	switch (letter)
+	{
+	case 0x44: return FILE_DEL; // 'D'
+	case 0x53: return FILE_SEQ; // 'S'
+	case 0x50: return FILE_PRG; // 'P'
+	case 0x55: return FILE_USR; // 'U'
+	case 0x52: return FILE_REL; // 'R'
+	default:   return -1;
+	}
+}
 
-	if (d->filetype == FILE_DEL)
-		return false;
+bool Diskimage::Dirfilter::all() const
+{
+	return m_patterns.empty() && m_filetype < 0;
+}
 
-	std::vector<unsigned char>* ppetsciiname =
-			(std::vector<unsigned char>*)name;
+bool Diskimage::Dirfilter::matches(const unsigned char *name, int filetype) const
+{
+	unsigned char key[16];
+	int keylen = normalise_dirname(name, key);
+	return matches_key(key, keylen, filetype);
+}
 
-	if (match_name(*ppetsciiname, d->name))
-	{
+bool Diskimage::Dirfilter::matches_key(const unsigned char *key, int keylen, int filetype) const
+{
+	if (m_filetype >= 0 && (filetype & 0x07) != m_filetype)
+		return false;
+	if (m_patterns.empty())
 		return true;
+	for (size_t i = 0; i < m_patterns.size(); ++i)
+	{
+		if (match_name(m_patterns[i], key, keylen))
+			return true;
 	}
 	return false;
 }
 
-static bool direntry_last_block_matcher(Diskimage::Direntry *d, int entry_index, void *)
+// Evaluated against the index keys, the directory blocks are not walked
+void Diskimage::find_direntries(const Dirfilter& filter, std::vector<const Direntry *>& entries)
 {
-	if (!d)
-		return false;
-
-	if (entry_index == 0 && d->link_track == 0 && d->link_sector == 0xff)
-		return true;
+	entries.clear();
+	for (size_t slot = 0; slot < m_slots.size(); ++slot)
+	{
+		const Dirslot &ds = m_slots[slot];
+		if (ds.entry->filetype != FILE_DEL &&
+		    filter.matches_key(ds.key, ds.keylen, ds.entry->filetype))
+			entries.push_back(ds.entry);
+	}
+}
 
-	return false;
+Diskimage::Direntry* Diskimage::find_free_direntry()
+{
+	for (size_t slot = 0; slot < m_slots.size(); ++slot)
+	{
+		if (m_slots[slot].entry->filetype == FILE_DEL)
+			return m_slots[slot].entry;
+	}
+	return NULL;
 }
 
 bool Diskimage::opendir( Dirstate& dirstate )
@@ -675,7 +1023,7 @@ bool Diskimage::readdir( Dirstate& dirstate, Direntry& direntry )
 size_t Diskimage::read_file( std::vector<unsigned char>& data,
 		std::vector<unsigned char>& petsciiname )
 {
-	Direntry *direntry = find_matching_direntry(direntry_name_matcher, &petsciiname, NULL);
+	Direntry *direntry = find_direntry(petsciiname);
 	if (direntry == NULL)
 	{
 		std::string asciiname;
@@ -684,51 +1032,74 @@ size_t Diskimage::read_file( std::vector<unsigned char>& data,
 		throw raspbiec_error(IEC_FILE_NOT_FOUND);
 	}
 
-	int track  = direntry->first_track;
-	int sector = direntry->first_sector;
-	Dataentry *db = NULL;
-	do
+	int handle = open_handle(direntry);
+	dataspan span;
+	try
 	{
-		db = (Dataentry *)block(track,sector);
-		track  = db->link_track;
-		sector = db->link_sector;
-		if (track != 0)
+		while (read_span(handle, span))
 		{
-			data.insert(data.end(), db->data, db->data + Dataentry::size);
-		}
-		else // Last block
-		{
-			data.insert(data.end(), db->data, db->data + (sector - offsetof(Dataentry, data)) + 1);
+			data.insert(data.end(), span.data, span.data + span.len);
 		}
 	}
-	while (track != 0);
+	catch (raspbiec_error &e)
+	{
+		close_file(handle);
+		throw;
+	}
+	close_file(handle);
 
 	return data.size();
 }
 
 size_t Diskimage::write_file( std::vector<unsigned char>& data,
 		std::vector<unsigned char>& petsciiname )
+{
+	// Real 1541 will try to save and then abort if there is no space
+	// We can check it beforehand
+	int blocks = (data.size() + Dataentry::size-1)/Dataentry::size;
+	int handle = create_file(petsciiname, blocks);
+	try
+	{
+		if (!data.empty()) write_span(handle, data.data(), data.size());
+		commit_file(handle);
+	}
+	catch (raspbiec_error &e)
+	{
+		abort_file(handle);
+		throw;
+	}
+	return 0;
+}
+
+/* Start writing a new file, return a handle for write_span().
+ * Like the 1541, the direntry is there from the start but the file
+ * is not closed ("splat") until commit_file().
+ * blocks: size of the file if known beforehand, -1 if not
+ */
+int Diskimage::create_file(const std::vector<unsigned char>& petsciiname, int blocks)
 {
 	// TODO: check for zero length data
 	// Get first free direntry slot
-	Direntry_state des;
-	Direntry *direntry = find_matching_direntry(direntry_free_slot_matcher, NULL, &des);
-	if (direntry == NULL)
+	Direntry *direntry = find_free_direntry();
+	if (direntry == NULL && !m_slots.empty())
 	{
 		// No space in the current directory blocks, get new
-		Direntry_state last;
-		direntry = find_matching_direntry(direntry_last_block_matcher, NULL, &last);
-		if (find_next_free_block(last.track, last.sector, diskinfo[m_disktype].dir_interleave))
+		Dirslot &last = m_slots.back();
+		int track  = last.track;
+		int sector = last.sector;
+		if (find_next_free_block(track, sector, diskinfo[m_disktype].dir_interleave))
 		{
-			set_block_allocation(last.track, last.sector, true);
-			direntry->link_track = last.track;
-			direntry->link_sector = last.sector;
-			unsigned char *new_dirblock = block(last.track, last.sector);
+			set_block_allocation(track, sector, true);
+			Direntry *last_block = last.entry - 7;
+			last_block->link_track = track;
+			last_block->link_sector = sector;
+			set_dirty(last_block);
+			unsigned char *new_dirblock = modify_block(track, sector);
 			std::fill(new_dirblock, new_dirblock + 256, 0x00);
 			direntry = (Direntry *)new_dirblock;
 			direntry->link_track = 0x00;
 			direntry->link_sector = 0xff;
-			des = last;
+			add_dirblock(track, sector);
 		}
 	}
 
@@ -738,9 +1109,6 @@ size_t Diskimage::write_file( std::vector<unsigned char>& data,
 		throw raspbiec_error(IEC_NO_SPACE_LEFT_ON_DEVICE);
 	}
 
-	// Real 1541 will try to save and then abort if there is no space
-	// We can check it beforehand
-	int blocks = (data.size() + Dataentry::size-1)/Dataentry::size;
 	if (blocks > blocks_free())
 	{
 		fprintf(stderr,"No space left on device\n");
@@ -766,53 +1134,292 @@ size_t Diskimage::write_file( std::vector<unsigned char>& data,
 	std::fill(direntry->name, direntry->name + COUNT_OF(direntry->name), 0xA0);
 	int name_len = std::min(petsciiname.size(), COUNT_OF(direntry->name));
 	std::copy(petsciiname.begin(), petsciiname.begin() + name_len, direntry->name);
+	set_dirty(direntry);
+	int slot = slot_of(direntry);
+	unindex_slot(slot);
+	index_slot(slot);
+
+	int handle = new_handle();
+	Filehandle &f = m_files[handle];
+	f.writing = true;
+	f.direntry = direntry;
+	f.track = track;
+	f.sector = sector;
+	f.fill = 0;
+	f.blocks = 1;
+	return handle;
+}
 
-	int blocks_written = 0;
-	std::vector<unsigned char>::iterator write_data = data.begin();
-
-	for (;;)
+// Append data to a file from create_file(), allocating blocks as needed
+void Diskimage::write_span(int handle, const unsigned char *data, size_t len)
+{
+	Filehandle &f = write_handle(handle);
+	while (len > 0)
 	{
-		Dataentry *datablock = (Dataentry *)block(track, sector);
-		unsigned char *db = datablock->data;
-		unsigned char *db_end = datablock->data + Dataentry::size;
-		while (db != db_end && write_data != data.end())
-		{
-			*db++ = *write_data++;
-		}
-		++blocks_written;
-
-		if (write_data != data.end()) // More data to be written, get a new block
+		Dataentry *datablock = (Dataentry *)modify_block(f.track, f.sector);
+		if (f.fill == Dataentry::size) // More data to be written, get a new block
 		{
-			if (!find_next_free_block(track, sector, diskinfo[m_disktype].interleave))
+			if (!find_next_free_block(f.track, f.sector, diskinfo[m_disktype].interleave))
 			{
 				fprintf(stderr,"No space left on device\n");
 				throw raspbiec_error(IEC_NO_SPACE_LEFT_ON_DEVICE);
 			}
-			set_block_allocation(track, sector, true);
-			datablock->link_track = track;
-			datablock->link_sector = sector;
-		}
-		else
-		{
-			datablock->link_track = 0;
-			// The index of the last good data byte in the sector
-			datablock->link_sector = offsetof(Dataentry, data) + (db - datablock->data) - 1;
-			break;
+			set_block_allocation(f.track, f.sector, true);
+			datablock->link_track = f.track;
+			datablock->link_sector = f.sector;
+			datablock = (Dataentry *)modify_block(f.track, f.sector);
+			f.fill = 0;
+			++f.blocks;
 		}
+		size_t n = std::min(len, Dataentry::size - f.fill);
+		std::copy(data, data + n, datablock->data + f.fill);
+		f.fill += n;
+		data += n;
+		len -= n;
 	}
+}
+
+// Terminate the sector chain and close the file
+void Diskimage::commit_file(int handle)
+{
+	Filehandle &f = write_handle(handle);
+
+	Dataentry *datablock = (Dataentry *)modify_block(f.track, f.sector);
+	datablock->link_track = 0;
+	// The index of the last good data byte in the sector
+	datablock->link_sector = offsetof(Dataentry, data) + f.fill - 1;
 
+	Direntry *direntry = f.direntry;
 	direntry->filetype |= FILE_CLOSED;
-	direntry->size_hi = (blocks_written & 0xff00) >> 8;
-	direntry->size_lo = blocks_written & 0x00ff;
-	return 0;
+	direntry->size_hi = (f.blocks & 0xff00) >> 8;
+	direntry->size_lo = f.blocks & 0x00ff;
+	set_dirty(direntry);
+	f.open = false;
 }
 
-int Diskimage::open_file(std::vector<unsigned char>& petsciiname)
+// Remove a file from create_file() and free its blocks
+void Diskimage::abort_file(int handle)
 {
-	return 0;
+	Filehandle &f = write_handle(handle);
+
+	int track  = f.direntry->first_track;
+	int sector = f.direntry->first_sector;
+	for (int i = 0; i < f.blocks; ++i)
+	{
+		set_block_allocation(track, sector, false);
+		Dataentry *datablock = (Dataentry *)block(track, sector);
+		track  = datablock->link_track;
+		sector = datablock->link_sector;
+	}
+
+	int slot = slot_of(f.direntry);
+	unindex_slot(slot);
+	f.direntry->filetype = FILE_DEL;
+	set_dirty(f.direntry);
+	f.open = false;
+}
+
+Diskimage::Filehandle& Diskimage::write_handle(int handle)
+{
+	if (handle < 0 || (size_t)handle >= m_files.size() ||
+			!m_files[handle].open || !m_files[handle].writing)
+		throw raspbiec_error(IEC_ILLEGAL_STATE);
+
+	return m_files[handle];
+}
+
+int Diskimage::new_handle()
+{
+	size_t handle = 0;
+	while (handle < m_files.size() && m_files[handle].open) ++handle;
+	if (handle == m_files.size()) m_files.push_back(Filehandle());
+
+	Filehandle &f = m_files[handle];
+	f.open = true;
+	f.writing = false;
+	f.direntry = NULL;
+	f.fill = 0;
+	f.blocks = 0;
+	return handle;
+}
+
+// Return a handle for reading the file with read_span(), -1 if not found
+int Diskimage::open_file(const std::vector<unsigned char>& petsciiname)
+{
+	Direntry *direntry = find_direntry(petsciiname);
+	if (direntry == NULL)
+		return -1;
+
+	return open_handle(direntry);
+}
+
+int Diskimage::open_handle(Direntry *direntry)
+{
+	int handle = new_handle();
+	Filehandle &f = m_files[handle];
+	f.direntry = direntry;
+	f.track = f.first_track = direntry->first_track;
+	f.sector = f.first_sector = direntry->first_sector;
+	f.blocks_left = m_dirty_blocks.size();
+	f.skip = 0;
+	return handle;
+}
+
+// Hand out the data part of the next block in the file's chain,
+// pointing straight into the image. Return false at the end of file.
+bool Diskimage::read_span(int handle, dataspan &span)
+{
+	if (handle < 0 || (size_t)handle >= m_files.size() ||
+			!m_files[handle].open || m_files[handle].writing)
+		throw raspbiec_error(IEC_ILLEGAL_STATE);
+
+	Filehandle &f = m_files[handle];
+	if (f.track == 0)
+		return false;
+
+	if (f.blocks_left-- == 0)
+	{
+		fprintf(stderr,"Looping sector chain\n");
+		throw raspbiec_error(IEC_DISK_IMAGE_ERROR);
+	}
+
+	Dataentry *db = (Dataentry *)block(f.track, f.sector);
+	f.track  = db->link_track;
+	f.sector = db->link_sector;
+	span.data = db->data;
+	if (f.track != 0)
+	{
+		span.len = Dataentry::size;
+	}
+	else // Last block, sector is the index of the last byte
+	{
+		span.len = (f.sector >= (int)offsetof(Dataentry, data)) ?
+				f.sector - offsetof(Dataentry, data) + 1 : 0;
+	}
+	size_t skip = std::min(f.skip, span.len);
+	span.data += skip;
+	span.len -= skip;
+	f.skip = 0;
+	return true;
+}
+
+// Walk the chain again from the start up to the block holding
+// the offset. Return false if the file is shorter than that.
+bool Diskimage::seek(int handle, size_t offset)
+{
+	if (handle < 0 || (size_t)handle >= m_files.size() ||
+			!m_files[handle].open || m_files[handle].writing)
+		throw raspbiec_error(IEC_ILLEGAL_STATE);
+
+	Filehandle &f = m_files[handle];
+	f.track = f.first_track;
+	f.sector = f.first_sector;
+	f.blocks_left = m_dirty_blocks.size();
+	f.skip = 0;
+	while (offset >= Dataentry::size)
+	{
+		if (f.track == 0)
+			return false;
+		if (f.blocks_left-- == 0)
+		{
+			fprintf(stderr,"Looping sector chain\n");
+			throw raspbiec_error(IEC_DISK_IMAGE_ERROR);
+		}
+		Dataentry *db = (Dataentry *)block(f.track, f.sector);
+		f.track  = db->link_track;
+		f.sector = db->link_sector;
+		offset -= Dataentry::size;
+	}
+	f.skip = offset;
+	return true;
 }
 
 bool Diskimage::close_file(int handle)
 {
-	return false;
+	if (handle < 0 || (size_t)handle >= m_files.size() || !m_files[handle].open)
+		return false;
+
+	m_files[handle].open = false;
+	return true;
+}
+
+bool Diskimage::file_name(int handle, std::vector<unsigned char> &petsciiname)
+{
+	if (handle < 0 || (size_t)handle >= m_files.size() ||
+			!m_files[handle].open || m_files[handle].writing)
+		return false;
+
+	const unsigned char *name = m_files[handle].direntry->name;
+	size_t len = 0;
+	while (len < 16 && name[len] != 0xA0) ++len;
+	petsciiname.assign(name, name + len);
+	return true;
+}
+
+bool Diskimage::position(int handle, int &track, int &sector)
+{
+	if (handle < 0 || (size_t)handle >= m_files.size() || !m_files[handle].open)
+		return false;
+
+	track = m_files[handle].track;
+	sector = m_files[handle].sector;
+	return true;
+}
+
+Diskimage_file::Diskimage_file(Diskimage &image, int handle) :
+		m_image(image),
+		m_handle(handle)
+{
+}
+
+bool Diskimage_file::next_span(dataspan &span)
+{
+	return m_image.read_span(m_handle, span);
+}
+
+Diskimage_writer::Diskimage_writer(Diskimage &image,
+		const std::vector<unsigned char>& petsciiname) :
+		m_image(image),
+		m_handle(image.create_file(petsciiname, -1)),
+		m_status(IEC_OK)
+{
+}
+
+Diskimage_writer::~Diskimage_writer()
+{
+	if (m_handle >= 0)
+	{
+		try
+		{
+			m_image.abort_file(m_handle);
+		}
+		catch (raspbiec_error &e)
+		{
+		}
+	}
+}
+
+// An error is reported only at commit(), the rest of the data
+// is still accepted from the bus like a real drive does
+void Diskimage_writer::write(const unsigned char *data, size_t len)
+{
+	if (m_status != IEC_OK)
+		return;
+	try
+	{
+		m_image.write_span(m_handle, data, len);
+	}
+	catch (raspbiec_error &e)
+	{
+		m_status = e.status();
+	}
+}
+
+void Diskimage_writer::commit()
+{
+	flush_chunk();
+	if (m_status != IEC_OK)
+		throw raspbiec_error(m_status);
+	m_image.commit_file(m_handle);
+	m_handle = -1;
 }
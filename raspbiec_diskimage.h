@@ -19,13 +19,27 @@
 #ifndef RASPBIEC_DISKIMAGE_H
 #define RASPBIEC_DISKIMAGE_H
 
+#include <stdint.h>
 #include <vector>
 #include <string>
+#include "raspbiec_types.h"
 
 struct Diskentry;
 struct BAMentry;
 struct Dataentry;
 
+// Direntry file types, see raspbiec_diskimage.cpp for the layout
+enum Filetype
+{
+	FILE_DEL       = 0x0,
+	FILE_SEQ       = 0x1,
+	FILE_PRG       = 0x2,
+	FILE_USR       = 0x3,
+	FILE_REL       = 0x4,
+	FILE_LOCKED = 1<<6,
+	FILE_CLOSED = 1<<7,
+};
+
 class Diskimage
 {
 public:
@@ -35,8 +49,16 @@ public:
 	void open(const char *path);
 	void close();
 	void flush();
+	// Changes whenever the image contents do or another image is opened
+	unsigned long generation() const { return m_generation; }
+	// The image file and where its tracks are in it, for reading
+	// it without the mapping
+	int image_fd() const { return m_fd; }
+	void layout(image_layout &tracks);
 
 	unsigned char *block(int track, int sector);
+	// As block(), but the block gets written back on flush()
+	unsigned char *modify_block(int track, int sector);
 
 	size_t read_file( std::vector<unsigned char>& data,
 			std::vector<unsigned char>& petsciiname );
@@ -48,8 +70,21 @@ public:
 	bool track_is_full(int track);
 	bool find_first_free_block(int& track, int& sector);
 	bool find_next_free_block(int& track, int& sector, int interleave);
-	int open_file(std::vector<unsigned char>& petsciiname);
+	// Streaming reads, no copy of the file is made
+	int open_file(const std::vector<unsigned char>& petsciiname);
+	bool read_span(int handle, dataspan &span);
+	// Continue reading a handle from a byte offset of the file
+	bool seek(int handle, size_t offset);
 	bool close_file(int handle);
+	// Name of the file a read handle has open, a pattern resolved
+	bool file_name(int handle, std::vector<unsigned char> &petsciiname);
+	// Next block of a read handle, the first one right after open_file()
+	bool position(int handle, int &track, int &sector);
+	// Streaming writes, the file is complete after commit_file()
+	int create_file(const std::vector<unsigned char>& petsciiname, int blocks);
+	void write_span(int handle, const unsigned char *data, size_t len);
+	void commit_file(int handle);
+	void abort_file(int handle);
 
 
 	class Direntry_state
@@ -92,26 +127,135 @@ public:
 	bool readdir( Dirstate& dirstate, Direntry& direntry );
 	// No closedir() needed
 
+	// Selection of a directory listing, "$[drive][:pattern[,pattern...]][=type]"
+	class Dirfilter
+	{
+	public:
+		Dirfilter();
+		explicit Dirfilter(const std::vector<unsigned char>& petsciiname);
+		// True when every file is listed
+		bool all() const;
+		// <name> as in a direntry, padded with shift-space
+		bool matches(const unsigned char *name, int filetype) const;
+		// <key> is a normalised name
+		bool matches_key(const unsigned char *key, int keylen, int filetype) const;
+	private:
+		static int filetype_of(unsigned char letter);
+
+		std::vector<std::vector<unsigned char> > m_patterns; // Normalised
+		int m_filetype; // -1 == any type
+	};
+	// File name matching as in lookups, <pattern> and <key> normalised
+	static unsigned char normalise(unsigned char petschar);
+	static bool name_matches(const std::vector<unsigned char>& pattern,
+				 const unsigned char *key, int keylen);
+	// Entries in directory order selected by <filter>
+	void find_direntries(const Dirfilter& filter, std::vector<const Direntry *>& entries);
+
 private:
-	Direntry* find_matching_direntry(
-			bool (*matcher)(Direntry *d, int entry_index, void *userdata),
-			void *userdata,
-			Direntry_state *de_state );
+	// Directory index, built on open() and kept up to date by write_file()
+	struct Dirslot
+	{
+		Direntry *entry;
+		int track;  // Directory block of the entry
+		int sector;
+		unsigned char key[16]; // Normalised name, valid if indexed
+		int keylen;
+		bool indexed; // In the hash chain, and the prefix chain if keylen > 0
+		int hash_next;   // Next slot in the same hash bucket, -1 == end
+		int prefix_next; // Next slot with the same first character
+	};
+	static const int dir_hash_size = 256;
+
+	void build_index();
+	void add_dirblock(int track, int sector);
+	void index_slot(int slot);
+	void unindex_slot(int slot);
+	int slot_of(const Direntry *d);
+
+	void decode_bam();
+	bool counts_as_free(int track);
+	Direntry* find_direntry(const std::vector<unsigned char>& petsciiname);
+	Direntry* find_free_direntry();
+	int open_handle(Direntry *direntry);
 
 	bool valid_ts(int track, int sector);
 	int block_number(int track, int sector);
 	size_t block_offset(int track, int sector);
+	void set_dirty(const void *p);
 
 private:
-	std::vector<unsigned char> m_image;
+	// Private mapping of the image file, changes reach
+	// the file only through flush()
+	int m_fd;
+	unsigned char *m_image;
+	size_t m_image_size;
 	std::string m_imagename;
 
 	int m_disktype;
 	Diskentry *m_disk_block;
 
 	bool m_dirty;
+	std::vector<bool> m_dirty_blocks;
+	unsigned long m_generation;
+	bool m_written; // Needs fsync() on close
 	bool m_mounted;
+
+	std::vector<Dirslot> m_slots; // Every directory slot in directory order
+	std::vector<int> m_dirblock_slot; // First slot of each directory block, by block number
+	int m_hash_head[dir_hash_size];
+	int m_prefix_head[256];
+
+	// Decoded BAM, kept in sync by set_block_allocation()
+	static const int max_tracks = 40;
+	uint32_t m_free_mask[max_tracks+1]; // Bit n set == sector n free, by track
+	int m_blocks_free; // Total as shown in the directory
+
+	// Read cursors and write positions of open files
+	struct Filehandle
+	{
+		bool open;
+		bool writing;
+		int track; // Next block to read (track 0 == end of file) or current block to write
+		int sector;
+		size_t blocks_left; // Guards against looping chains
+		int first_track; // Start of the chain being read
+		int first_sector;
+		size_t skip; // Bytes of the next block already read
+		Direntry *direntry; // File being read or written
+		size_t fill; // Bytes in the current block being written
+		int blocks; // Blocks written
+	};
+	std::vector<Filehandle> m_files;
+	int new_handle();
+	Filehandle& write_handle(int handle);
+};
+
+// An open file of a disk image as a source of spans
+class Diskimage_file : public dataspan_source
+{
+public:
+	Diskimage_file(Diskimage &image, int handle);
+	virtual bool next_span(dataspan &span);
+private:
+	Diskimage &m_image;
+	int m_handle;
 };
 
+// A new file on a disk image, receiving data from the bus.
+// Removed again unless commit() is called.
+class Diskimage_writer : public datasink
+{
+public:
+	Diskimage_writer(Diskimage &image, const std::vector<unsigned char>& petsciiname);
+	~Diskimage_writer();
+	virtual void commit();
+protected:
+	virtual void write(const unsigned char *data, size_t len);
+private:
+	Diskimage &m_image;
+	int m_handle;
+	int m_status;
+};
 
 #endif // RASPBIEC_DISKIMAGE_H
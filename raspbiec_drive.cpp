@@ -17,17 +17,72 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <cctype>
+#include <algorithm>
 //#include <unordered_map>
 #include "raspbiec_drive.h"
 #include "raspbiec_exception.h"
 #include "raspbiec_utils.h"
 
+// RASPBIEC_CACHE_KB sets the memory for recently loaded files
+static size_t file_cache_budget()
+{
+	const char *kb = getenv("RASPBIEC_CACHE_KB");
+	return (kb ? strtoul(kb, NULL, 10) : 4096) * 1024;
+}
+
+// RASPBIEC_HISTORY names the file for learned load sequences,
+// ~/.raspbiec_history by default
+static std::string load_history_file()
+{
+	const char *file = getenv("RASPBIEC_HISTORY");
+	if (file != NULL)
+		return file;
+	const char *home = getenv("HOME");
+	return home ? std::string(home) + "/.raspbiec_history" : std::string();
+}
+
+// RASPBIEC_METRICS names a node exporter textfile for the service
+// metrics, rewritten every RASPBIEC_METRICS_INTERVAL seconds (15)
+static void start_metrics(drive_metrics &metrics)
+{
+	const char *file = getenv("RASPBIEC_METRICS");
+	if (file == NULL || *file == '\0')
+		return;
+	const char *interval = getenv("RASPBIEC_METRICS_INTERVAL");
+	metrics.start(file, interval ? strtoul(interval, NULL, 10) : 15);
+}
+
+static const char *command_name(device::Command cmd)
+{
+	switch (cmd)
+	{
+	case device::Open:               return "open";
+	case device::Close:              return "close";
+	case device::Receive:            return "receive";
+	case device::Send:               return "send";
+	case device::Unlisten:           return "unlisten";
+	case device::Untalk:             return "untalk";
+	case device::Exit:               return "exit";
+	case device::OpenOtherDevice:    return "open_other_device";
+	case device::CloseOtherDevice:   return "close_other_device";
+	case device::ReceiveOtherDevice: return "receive_other_device";
+	case device::SendOtherDevice:    return "send_other_device";
+	default:                         return "unknown";
+	}
+}
+
 drive::drive(const int device_number, pipefd &bus, bool foreground) :
             m_dev(foreground),
 			m_device_number(device_number),
 			m_imagemode(false),
+			m_cache(file_cache_budget()),
+			m_predictions(0),
+			m_prefetch_hits(0),
+			m_last_pinned(false),
 			m_foreground(foreground)
 {
 	m_dev.set_identity(device_number, bus);
@@ -37,6 +92,12 @@ drive::~drive()
 {
 }
 
+// "$" and its filtered forms like "$0:A*,B*=P" list the directory
+static bool is_directory(const drive::channel &ch)
+{
+	return !ch.petscii.empty() && ch.petscii[0] == 0x24;
+}
+
 void drive::serve(const char *path)
 {
 	struct stat stb;
@@ -59,6 +120,11 @@ void drive::serve(const char *path)
 		fprintf(stderr, "Cannot access '%s'\n", path);
 		throw raspbiec_error(IEC_FILE_NOT_FOUND);
 	}
+	// Sequences are learned per image or directory
+	char *context = realpath(path, NULL);
+	m_history.open(load_history_file(), context ? context : path);
+	free(context);
+
 	if (!m_imagemode && chdir(path)==-1)
 	{
 		fprintf(stderr, "Cannot change to directory '%s'\n", path);
@@ -66,6 +132,7 @@ void drive::serve(const char *path)
 	}
 
 	reset_channels();
+	start_metrics(m_metrics);
 
 	printf("Entering disk drive service loop\n"
 			"Exit with Ctrl-C or SIGINT\n");
@@ -82,6 +149,7 @@ void drive::serve(const char *path)
 			channel *pch = NULL;
 			cmd = m_dev.receive_command(m_device_number, sa, command_byte);
 			command_byte = 0;
+			m_metrics.command(command_name(cmd));
 			if (sa >= 0 && sa <=15)
 			{
 				pch = &channels[sa];
@@ -131,8 +199,9 @@ void drive::serve(const char *path)
 				if (sa == 1)
 				{
 					printf("Save \"%s\"\n",pch->ascii.c_str());
-					m_dev.receive_from_bus_verbose(back_inserter(pch->data));
-					write_to_disk(*pch);
+					request_timer timer(m_dev);
+					receive_to_disk(*pch);
+					timer.done(m_metrics, "save", true);
 				}
 				else if (sa >= 2 && sa <= 14)
 				{
@@ -157,20 +226,40 @@ void drive::serve(const char *path)
 				if (sa == 0)
 				{
 					printf("Load \"%s\"\n",pch->ascii.c_str());
-					read_from_disk(*pch);
-					databuf_iter sent = m_dev.send_to_bus_verbose(pch->data.begin(), pch->data.end());
-					if (sent != pch->data.end())
+					request_timer timer(m_dev);
+					bool complete;
+					if (is_directory(*pch))
+					{
+						complete = send_directory(*pch);
+					}
+					else if (pch->replay)
+					{
+						complete = send_last_program(*pch);
+					}
+					else if (m_imagemode)
+					{
+						complete = send_from_image(*pch);
+					}
+					else
+					{
+						complete = send_from_local(*pch);
+					}
+					timer.done(m_metrics, is_directory(*pch) ? "directory" : "load", complete);
+					if (!complete)
 					{
 						printf("?break\n");
 					}
-					pch->data.erase(pch->data.begin(), sent);
+					else if (!is_directory(*pch) && !pch->replay)
+					{
+						remember_last_program(*pch);
+						prefetch_next(*pch);
+					}
 				}
 				else if (sa >= 2 && sa <= 14)
 				{
 					printf("Read %d:\"%s\"\n",sa,pch->ascii.c_str());
 					// TODO data read according to file type
-					databuf_iter sent = m_dev.send_to_bus_verbose(pch->data.begin(), pch->data.end());
-					pch->data.erase(pch->data.begin(), sent);
+					send_buffered(*pch);
 				}
 				else if (sa == 15)
 				{
@@ -186,6 +275,10 @@ void drive::serve(const char *path)
 				break;
 			case device::Exit:
 				printf("\nExiting disk drive service loop\n");
+				printf("File cache: %lu hits, %lu misses\n",
+					   m_cache.hits(), m_cache.misses());
+				printf("Prefetch: %lu of %lu predictions used\n",
+					   m_prefetch_hits, m_predictions);
 				break;
 			case device::OpenOtherDevice:
 				printf("Open other device\n");
@@ -211,6 +304,7 @@ void drive::serve(const char *path)
 		catch( raspbiec_error &e )
 		{
 			int status = e.status();
+			m_metrics.error(status);
 			if (status == IEC_ILLEGAL_STATE)
 				throw;
 
@@ -228,8 +322,15 @@ void drive::serve(const char *path)
 				//reset_channels();
 			}
 		}
+		if (m_metrics.enabled())
+		{
+			m_metrics.bus(m_dev.all_sent(), m_dev.all_received());
+			m_metrics.cache(m_cache.hits(), m_cache.misses(),
+					m_prefetch_hits, m_predictions);
+		}
 	}
 	while( cmd != device::Exit );
+	m_metrics.stop();
 
 	if (m_imagemode)
 	{
@@ -244,7 +345,13 @@ void drive::reset_channel(channel &ch)
 	ch.petscii.clear();
 	ch.ascii.clear();
 	ch.data.clear();
+	ch.sent = 0;
 	ch.fd = -1;
+	ch.cache_key.clear();
+	ch.cache_version.clear();
+	ch.from_cache = false;
+	ch.replay = false;
+	ch.hostname.clear();
 }
 
 void drive::reset_channels()
@@ -258,18 +365,44 @@ void drive::reset_channels()
 
 void drive::open_file(channel &ch)
 {
-	if (ch.number <= 14 && ch.ascii != "$")
+	// The save channel creates its file when the data arrives
+	if (ch.number != 1 && ch.number <= 14 && !is_directory(ch))
 	{
+		bool last = is_last_program(ch);
+		if (last)
+		{
+			if (last_program_valid())
+			{
+				ch.replay = true;
+				return;
+			}
+			ch.name = m_last_name; // Not in memory, load it again
+		}
+
 		if (m_imagemode)
-			ch.fd = m_img.open_file(ch.petscii);
+		{
+			ch.fd = m_img.open_file(ch.name);
+			image_identity(ch.fd, ch.cache_key, ch.cache_version);
+		}
 		else
-			ch.fd = open_local_file(ch.ascii.c_str(), "r"); // todo: mode
+		{
+			// Names the index does not know are tried as they are
+			std::string hostname;
+			if (last)
+				hostname = m_last_hostname;
+			else if (!m_listing.resolve_local(".", ch.name, hostname))
+				hostname = ch.ascii;
+			ch.fd = open_local_file(hostname.c_str(), "r"); // todo: mode
+			ch.hostname = hostname;
+			local_file_identity(ch.fd, ch.cache_key, ch.cache_version);
+		}
+		collect_prefetch(ch);
 	}
 }
 
 void drive::close_file(channel &ch)
 {
-	if (ch.number <= 14 && ch.ascii != "$")
+	if (ch.fd >= 0)
 	{
 		if (m_imagemode)
 			m_img.close_file(ch.fd);
@@ -278,32 +411,275 @@ void drive::close_file(channel &ch)
 	}
 }
 
-void drive::read_from_disk(channel &ch)
+// A local directory not in the listing cache is sent while it is
+// being scanned, otherwise the cached listing is sent
+bool drive::send_directory(channel &ch)
 {
-	if (ch.ascii == "$")
+	if (m_imagemode || m_listing.local_dir_valid("."))
 	{
-		if (m_imagemode)
-			read_diskimage_dir(ch.data, m_img, m_foreground);
-		else
-			read_local_dir(ch.data, ".", m_foreground);
+		read_directory(ch);
+		return send_buffered(ch);
 	}
-	else /* ordinary PRG file */
+
+	m_listing.begin_local_scan(".");
+	local_dir_scanner scanner(".", Diskimage::Dirfilter(ch.petscii));
+	bool complete;
+	m_dev.send_to_bus_verbose(scanner, complete);
+	if (complete)
 	{
-		if (m_imagemode)
-			m_img.read_file(ch.data, ch.name);
-		else
-			read_local_file(ch.data, ch.ascii.c_str());
+		m_listing.end_local_scan(scanner);
+		if (m_foreground) basic_listing(scanner.listing());
+	}
+	return complete;
+}
+
+void drive::read_directory(channel &ch)
+{
+	ch.data.clear();
+	ch.sent = 0;
+	Diskimage::Dirfilter filter(ch.petscii);
+	if (m_imagemode)
+		m_listing.read_diskimage_dir(ch.data, m_img, filter);
+	else
+		m_listing.read_local_dir(ch.data, ".", filter);
+	if (m_foreground) basic_listing(ch.data);
+}
+
+// Send what is left of the channel buffer, without moving the rest
+// of it around if the listener ends the transfer early
+bool drive::send_buffered(channel &ch)
+{
+	dataspan_list spans(1);
+	spans[0].data = ch.data.data() + ch.sent;
+	spans[0].len = ch.data.size() - ch.sent;
+	bool complete;
+	ch.sent += m_dev.send_to_bus_verbose(spans, complete);
+	if (ch.sent == ch.data.size())
+	{
+		ch.data.clear();
+		ch.sent = 0;
+	}
+	return complete;
+}
+
+// Stream the file straight from the image sectors to the bus
+bool drive::send_from_image(channel &ch)
+{
+	if (ch.fd < 0)
+	{
+		fprintf(stderr,"Could not open file '%s'\n",ch.ascii.c_str());
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+	bool complete;
+	if (send_cached(ch, complete))
+		return complete;
+	// A load broken off by the listener continues where it stopped
+	m_img.seek(ch.fd, ch.sent);
+	Diskimage_file file(m_img, ch.fd);
+	return send_and_cache(ch, file);
+}
+
+// Stream the file opened at OPEN, reading ahead while sending
+bool drive::send_from_local(channel &ch)
+{
+	if (ch.fd < 0)
+	{
+		fprintf(stderr,"Could not open local file '%s'\n",ch.ascii.c_str());
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
 	}
+	bool complete;
+	if (send_cached(ch, complete))
+		return complete;
+	// The reader has read ahead of what the listener took
+	if (lseek(ch.fd, ch.sent, SEEK_SET) < 0)
+	{
+		fprintf(stderr,"Could not seek local file '%s', error %d\n",ch.ascii.c_str(),errno);
+		throw raspbiec_error(IEC_FILE_READ_ERROR);
+	}
+	local_file_reader file(ch.fd);
+	return send_and_cache(ch, file);
 }
 
-void drive::write_to_disk(channel &ch)
+void drive::image_identity(int handle, std::string &key, std::string &version)
 {
+	int track, sector;
+	if (m_img.position(handle, track, sector))
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, "i%d/%d", track, sector);
+		key = buf;
+		snprintf(buf, sizeof buf, "%lu", m_img.generation());
+		version = buf;
+	}
+}
+
+// Put a read ahead file to the file cache, where the load finds it
+void drive::collect_prefetch(const channel &ch)
+{
+	std::string key, version;
+	databuf_t data;
+	if (m_prefetch.take(key, version, data))
+	{
+		m_cache.insert(key, version, data);
+		m_prefetched_key = key;
+	}
+	if (!m_prefetched_key.empty() && m_prefetched_key == ch.cache_key)
+	{
+		++m_prefetch_hits;
+	}
+	m_prefetched_key.clear();
+}
+
+// Read the file most likely to be loaded next while the computer
+// is busy with the one just sent
+void drive::prefetch_next(const channel &ch)
+{
+	databuf_t name(ch.name.size());
+	std::transform(ch.name.begin(), ch.name.end(), name.begin(), Diskimage::normalise);
+	m_history.loaded(name);
+	if (!m_history.predict(name))
+		return;
+
+	++m_predictions;
 	if (m_imagemode)
-		m_img.write_file(ch.data, ch.name);
+	{
+		// The image is mapped, the chain is read from its file on the
+		// prefetch thread so that the blocks are not faulted in here
+		int handle = m_img.open_file(name);
+		if (handle < 0)
+			return;
+		std::string key, version;
+		image_identity(handle, key, version);
+		int track, sector;
+		if (!m_cache.contains(key, version) && m_img.position(handle, track, sector))
+		{
+			image_layout layout;
+			m_img.layout(layout);
+			m_prefetch.start_chain(m_img.image_fd(), layout, track, sector);
+		}
+		m_img.close_file(handle);
+		m_prefetched_key = key;
+	}
 	else
-		write_local_file(ch.data, ch.ascii.c_str());
+	{
+		std::string hostname;
+		if (m_listing.resolve_local(".", name, hostname))
+			m_prefetch.start(hostname, m_cache.budget());
+	}
 }
 
+// '*' on the load channel means the last program loaded, when there
+// is one. Otherwise it is a pattern matching the first file.
+bool drive::is_last_program(const channel &ch)
+{
+	return ch.number == 0 && !m_last_name.empty() &&
+		!ch.name.empty() && ch.name[0] == 0x2A;
+}
+
+// The kept program is good as long as its file has not changed,
+// which is seen without following the directory or the chain
+bool drive::last_program_valid()
+{
+	if (!m_last_pinned)
+		return false;
+
+	std::string key = m_last_key;
+	std::string version;
+	if (m_imagemode)
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, "%lu", m_img.generation());
+		version = buf;
+	}
+	else if (!local_file_identity(m_last_hostname.c_str(), key, version))
+	{
+		return false;
+	}
+	return key == m_last_key && version == m_last_version;
+}
+
+// The file cache has the data of a completed load unless it is
+// larger than the cache
+void drive::remember_last_program(const channel &ch)
+{
+	// The file that was loaded, not the pattern that found it
+	if (m_imagemode)
+	{
+		if (!m_img.file_name(ch.fd, m_last_name))
+			m_last_name = ch.name;
+	}
+	else
+	{
+		ascii2petscii(ch.hostname, m_last_name);
+	}
+	m_last_hostname = ch.hostname;
+	m_last_key = ch.cache_key;
+	m_last_version = ch.cache_version;
+	const databuf_t *data = m_cache.peek(ch.cache_key, ch.cache_version);
+	m_last_pinned = (data != NULL);
+	if (m_last_pinned)
+		m_last_program = *data;
+	else
+		databuf_t().swap(m_last_program);
+}
+
+bool drive::send_last_program(channel &ch)
+{
+	printf("Last program from memory\n");
+	dataspan_list spans(1);
+	spans[0].data = m_last_program.data() + ch.sent;
+	spans[0].len = m_last_program.size() - ch.sent;
+	bool complete;
+	ch.sent += m_dev.send_to_bus_verbose(spans, complete);
+	return complete;
+}
+
+// A file loaded before and not changed since is sent from memory
+bool drive::send_cached(channel &ch, bool &complete)
+{
+	if ((ch.sent != 0 && !ch.from_cache) || ch.cache_key.empty())
+		return false;
+	const databuf_t *data = m_cache.find(ch.cache_key, ch.cache_version);
+	if (data == NULL || data->size() < ch.sent)
+		return false;
+
+	dataspan_list spans(1);
+	spans[0].data = data->data() + ch.sent;
+	spans[0].len = data->size() - ch.sent;
+	ch.sent += m_dev.send_to_bus_verbose(spans, complete);
+	ch.from_cache = true;
+	return true;
+}
+
+// Files sent completely from the start are kept in the file cache
+bool drive::send_and_cache(channel &ch, dataspan_source &file)
+{
+	bool cacheable = (ch.sent == 0 && !ch.cache_key.empty());
+	copying_source copy(file, cacheable ? m_cache.budget() : 0);
+	bool complete;
+	ch.sent += m_dev.send_to_bus_verbose(copy, complete);
+	if (cacheable && complete && copy.complete_copy())
+		m_cache.insert(ch.cache_key, ch.cache_version, copy.copy());
+	return complete;
+}
+
+// The file is written while it is being received, and appears
+// complete or not at all when the data ends
+void drive::receive_to_disk(channel &ch)
+{
+	if (m_imagemode)
+	{
+		Diskimage_writer file(m_img, ch.name);
+		m_dev.receive_from_bus_verbose(datasink_iterator(file));
+		file.commit();
+	}
+	else
+	{
+		local_file_writer file(ch.ascii.c_str());
+		m_dev.receive_from_bus_verbose(datasink_iterator(file));
+		file.commit();
+	}
+}
 static int findchar(unsigned char c,
 		std::vector<unsigned char> vec)
 {
@@ -833,6 +1209,7 @@ void drive::receive_name_or_command(drive::channel &ch)
 	ch.petscii.clear();
 	m_dev.receive_from_bus(back_inserter(ch.petscii), 0);
 	petscii2ascii( ch.petscii, ch.ascii );
+	parse(ch);
 	if (ch.number == 15)
 		printf("command \"%s\"\n",ch.ascii.c_str());
 	else
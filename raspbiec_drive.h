@@ -26,6 +26,11 @@
 #include "raspbiec_common.h"
 #include "raspbiec_device.h"
 #include "raspbiec_diskimage.h"
+#include "raspbiec_utils.h"
+#include "raspbiec_listing.h"
+#include "raspbiec_filecache.h"
+#include "raspbiec_prefetch.h"
+#include "raspbiec_metrics.h"
 
 class drive
 {
@@ -69,12 +74,19 @@ public:
 		// Temporary data buffer, only contains data which has
 		// not yet been sent to bus or written to disk
 		std::vector<unsigned char> data;
+		size_t sent; // Bytes from the start of data already sent
 		// Info deduced from the name or command
 		std::vector<unsigned char> name;
 		std::vector<unsigned char> command;
 		unsigned char rwam;
 		unsigned char type;
 		int fd; // File descriptor for open
+		// Identity of the opened file in the file cache
+		std::string cache_key;
+		std::string cache_version;
+		bool from_cache; // Data has been sent from the file cache
+		bool replay; // LOAD"*" of the last program kept in memory
+		std::string hostname; // Local file opened
 
 		// Local file
 		int mode;
@@ -86,8 +98,21 @@ private:
 	void reset_channels();
 	void open_file(channel &ch);
 	void close_file(channel &ch);
-	void read_from_disk(channel &ch);
-	void write_to_disk(channel &ch);
+	bool send_directory(channel &ch);
+	void read_directory(channel &ch);
+	bool send_buffered(channel &ch);
+	bool send_from_image(channel &ch);
+	bool send_from_local(channel &ch);
+	bool send_cached(channel &ch, bool &complete);
+	bool send_and_cache(channel &ch, dataspan_source &file);
+	void image_identity(int handle, std::string &key, std::string &version);
+	void collect_prefetch(const channel &ch);
+	void prefetch_next(const channel &ch);
+	bool is_last_program(const channel &ch);
+	bool last_program_valid();
+	void remember_last_program(const channel &ch);
+	bool send_last_program(channel &ch);
+	void receive_to_disk(channel &ch);
 	void receive_name_or_command(channel &ch);
 	int determine_command(channel &ch);
 	int execute_command(channel &ch);
@@ -100,6 +125,21 @@ private:
 	channel channels[16];
 	bool m_imagemode;
 	Diskimage m_img;
+	dir_listing_cache m_listing;
+	file_cache m_cache;
+	load_history m_history;
+	local_file_prefetch m_prefetch;
+	std::string m_prefetched_key; // File read ahead for the next load
+	unsigned long m_predictions;
+	unsigned long m_prefetch_hits;
+	// Last program loaded, for LOAD"*"
+	std::vector<unsigned char> m_last_name;
+	std::string m_last_hostname;
+	std::string m_last_key;
+	std::string m_last_version;
+	databuf_t m_last_program;
+	bool m_last_pinned; // m_last_program holds the data
+	drive_metrics m_metrics;
 	bool m_foreground;
 };
 
@@ -0,0 +1,141 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include "raspbiec_filecache.h"
+
+file_cache::file_cache(size_t budget) :
+		m_budget(budget),
+		m_size(0),
+		m_hits(0),
+		m_misses(0)
+{
+}
+
+const databuf_t *file_cache::find(const std::string &key, const std::string &version)
+{
+	std::map<std::string, entry_iter>::iterator it = m_index.find(key);
+	if (it == m_index.end())
+	{
+		++m_misses;
+		return NULL;
+	}
+	if (it->second->version != version)
+	{
+		erase(it->second); // Changed since, never valid again
+		++m_misses;
+		return NULL;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	++m_hits;
+	return &m_lru.front().data;
+}
+
+void file_cache::insert(const std::string &key, const std::string &version, databuf_t &data)
+{
+	if (data.size() > m_budget)
+		return;
+
+	std::map<std::string, entry_iter>::iterator it = m_index.find(key);
+	if (it != m_index.end())
+		erase(it->second);
+	while (m_size + data.size() > m_budget)
+		erase(--m_lru.end());
+
+	m_lru.push_front(entry());
+	entry &e = m_lru.front();
+	e.key = key;
+	e.version = version;
+	e.data.swap(data);
+	m_size += e.data.size();
+	m_index[key] = m_lru.begin();
+}
+
+const databuf_t *file_cache::peek(const std::string &key, const std::string &version) const
+{
+	std::map<std::string, entry_iter>::const_iterator it = m_index.find(key);
+	if (it == m_index.end() || it->second->version != version)
+		return NULL;
+	return &it->second->data;
+}
+
+bool file_cache::contains(const std::string &key, const std::string &version) const
+{
+	return peek(key, version) != NULL;
+}
+
+void file_cache::erase(entry_iter it)
+{
+	m_size -= it->data.size();
+	m_index.erase(it->key);
+	m_lru.erase(it);
+}
+
+static void stat_identity(const struct stat &sb, std::string &key, std::string &version)
+{
+	char buf[64];
+	snprintf(buf, sizeof buf, "l%llu:%llu",
+		 (unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino);
+	key = buf;
+	snprintf(buf, sizeof buf, "%lld.%09ld:%lld",
+		 (long long)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec,
+		 (long long)sb.st_size);
+	version = buf;
+}
+
+bool local_file_identity(int fd, std::string &key, std::string &version)
+{
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) == -1)
+		return false;
+	stat_identity(sb, key, version);
+	return true;
+}
+
+bool local_file_identity(const char *name, std::string &key, std::string &version)
+{
+	struct stat sb;
+	if (stat(name, &sb) == -1)
+		return false;
+	stat_identity(sb, key, version);
+	return true;
+}
+
+copying_source::copying_source(dataspan_source &source, size_t limit) :
+		m_source(source),
+		m_limit(limit),
+		m_overflow(false)
+{
+}
+
+bool copying_source::next_span(dataspan &span)
+{
+	if (!m_source.next_span(span))
+		return false;
+	if (!m_overflow && m_copy.size() + span.len <= m_limit)
+	{
+		m_copy.insert(m_copy.end(), span.data, span.data + span.len);
+	}
+	else
+	{
+		m_overflow = true;
+		databuf_t().swap(m_copy);
+	}
+	return true;
+}
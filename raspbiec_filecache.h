@@ -0,0 +1,84 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_FILECACHE_H
+#define RASPBIEC_FILECACHE_H
+
+#include <string>
+#include <map>
+#include <list>
+#include "raspbiec_types.h"
+
+// Contents of recently served files within a byte budget, the least
+// recently used ones are dropped first. Each file is stored with a
+// version, e.g. an mtime, and is only found with the same version.
+class file_cache
+{
+public:
+	explicit file_cache(size_t budget);
+	// NULL on a miss, the data stays valid until the next insert()
+	const databuf_t *find(const std::string &key, const std::string &version);
+	// Takes the contents of <data>
+	void insert(const std::string &key, const std::string &version, databuf_t &data);
+	// As find(), but without touching the order or the counters
+	const databuf_t *peek(const std::string &key, const std::string &version) const;
+	bool contains(const std::string &key, const std::string &version) const;
+	size_t budget() const { return m_budget; }
+	unsigned long hits() const { return m_hits; }
+	unsigned long misses() const { return m_misses; }
+private:
+	struct entry
+	{
+		std::string key;
+		std::string version;
+		databuf_t data;
+	};
+	typedef std::list<entry>::iterator entry_iter;
+
+	void erase(entry_iter it);
+
+	std::list<entry> m_lru; // Most recently used first
+	std::map<std::string, entry_iter> m_index;
+	size_t m_budget;
+	size_t m_size;
+	unsigned long m_hits;
+	unsigned long m_misses;
+};
+
+// File cache identity of an open or a named local file
+bool local_file_identity(int fd, std::string &key, std::string &version);
+bool local_file_identity(const char *name, std::string &key, std::string &version);
+
+// Passes the spans of another source on and keeps a copy of them,
+// up to a limit
+class copying_source : public dataspan_source
+{
+public:
+	copying_source(dataspan_source &source, size_t limit);
+	virtual bool next_span(dataspan &span);
+	// False if the data did not fit in the limit
+	bool complete_copy() const { return !m_overflow; }
+	databuf_t &copy() { return m_copy; }
+private:
+	dataspan_source &m_source;
+	databuf_t m_copy;
+	size_t m_limit;
+	bool m_overflow;
+};
+
+#endif // RASPBIEC_FILECACHE_H
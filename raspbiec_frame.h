@@ -0,0 +1,235 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_FRAME_H
+#define RASPBIEC_FRAME_H
+
+/* Stream formats between userspace and the bus (device node or pipes)
+ *
+ * IEC_FORMAT_INT16:  one int16_t per bus entry, data bytes are 0..255
+ *                    and negative values are control codes/status.
+ *                    This is the original format and the fallback
+ *                    when the kernel module does not know the ioctl.
+ *
+ * IEC_FORMAT_FRAMED: a byte stream of frames
+ *                    0x00..0x7F  data run, header+1 payload bytes follow
+ *                    0x80 lo hi  control code -(lo|hi<<8)
+ *                    Other header values are illegal.
+ *                    A write() to the device returns the bytes used,
+ *                    frames may continue from one write to the next.
+ *
+ * Code shared by the kernel module and the userspace program,
+ * thus plain C.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#endif
+
+#define IEC_FORMAT_INT16   0
+#define IEC_FORMAT_FRAMED  1
+
+/* Select the stream format of the device node, argument is the format */
+#define RASPBIEC_IOC_MAGIC       'r'
+#define RASPBIEC_IOC_SET_FORMAT  _IOW(RASPBIEC_IOC_MAGIC, 1, int)
+
+#define IEC_FRAME_RUN_MAX        0x80 /* Max payload bytes in a data run */
+#define IEC_FRAME_CONTROL        0x80 /* Control frame header */
+#define IEC_FRAME_CONTROL_SIZE   3
+/* Worst case encoded size of n entries */
+#define IEC_FRAME_MAX_SIZE(n)    (IEC_FRAME_CONTROL_SIZE*(n))
+
+struct iec_frame_decoder
+{
+    int left;          /* Bytes left in the current frame */
+    int control;       /* Current frame is a control frame */
+    unsigned int code; /* Control code being assembled */
+};
+
+static inline void iec_frame_decoder_init(struct iec_frame_decoder *d)
+{
+    d->left = 0;
+    d->control = 0;
+    d->code = 0;
+}
+
+/* True when the decoder is not in the middle of a frame */
+static inline int iec_frame_decoder_idle(const struct iec_frame_decoder *d)
+{
+    return d->left == 0;
+}
+
+/* Encode as many entries of in[0..*count) as fit in out[0..len).
+ * *count is set to the number of entries encoded.
+ * Return the number of bytes used in out.
+ */
+static inline size_t iec_frame_encode(const int16_t *in, size_t *count,
+                                      unsigned char *out, size_t len)
+{
+    size_t i = 0;
+    size_t o = 0;
+    size_t run = 0;    /* Position of the current data run header */
+    size_t runlen = 0; /* Payload bytes in the current data run */
+
+    for (; i < *count; ++i)
+    {
+        if (in[i] >= 0)
+        {
+            if (runlen == 0 || runlen == IEC_FRAME_RUN_MAX)
+            {
+                if (o + 2 > len) break;
+                run = o++;
+                runlen = 0;
+            }
+            else if (o + 1 > len)
+            {
+                break;
+            }
+            out[o++] = (unsigned char)in[i];
+            out[run] = (unsigned char)runlen++;
+        }
+        else
+        {
+            unsigned int code = (unsigned int)(-(int)in[i]);
+            if (o + IEC_FRAME_CONTROL_SIZE > len) break;
+            out[o++] = IEC_FRAME_CONTROL;
+            out[o++] = (unsigned char)(code & 0xff);
+            out[o++] = (unsigned char)((code >> 8) & 0xff);
+            runlen = 0;
+        }
+    }
+    *count = i;
+    return o;
+}
+
+/* Decode the frames in in[0..len) to out, which must have room for
+ * len entries. Frames may continue over several calls.
+ * Return the number of entries decoded, -1 on an illegal frame header.
+ */
+static inline long iec_frame_decode(struct iec_frame_decoder *d,
+                                    const unsigned char *in, size_t len,
+                                    int16_t *out)
+{
+    long n = 0;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        unsigned char c = in[i];
+        if (d->left == 0) /* Frame header */
+        {
+            if (c < IEC_FRAME_CONTROL)
+            {
+                d->control = 0;
+                d->left = c + 1;
+            }
+            else if (c == IEC_FRAME_CONTROL)
+            {
+                d->control = 1;
+                d->code = 0;
+                d->left = IEC_FRAME_CONTROL_SIZE - 1;
+            }
+            else
+            {
+                return -1;
+            }
+        }
+        else if (!d->control)
+        {
+            out[n++] = c;
+            --d->left;
+        }
+        else
+        {
+            if (d->left == IEC_FRAME_CONTROL_SIZE - 1)
+            {
+                d->code = c;
+            }
+            else
+            {
+                d->code |= (unsigned int)c << 8;
+                out[n++] = (int16_t)(-(int)d->code);
+            }
+            --d->left;
+        }
+    }
+    return n;
+}
+
+/* As iec_frame_decode(), but decode at most max entries. A frame
+ * starting in in[] is only taken when all of its entries fit, a frame
+ * the decoder is already inside is continued as far as they fit.
+ * *len is set to the number of bytes used.
+ */
+static inline long iec_frame_decode_some(struct iec_frame_decoder *d,
+                                         const unsigned char *in, size_t *len,
+                                         int16_t *out, size_t max)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < *len; ++i)
+    {
+        unsigned char c = in[i];
+        if (d->left == 0)
+        {
+            size_t need = (c < IEC_FRAME_CONTROL) ? (size_t)c + 1 : 1;
+            if (c > IEC_FRAME_CONTROL)
+                return -1;
+            if (n + need > max)
+                break;
+        }
+        else if ((!d->control || d->left == 1) && n == max)
+        {
+            break;
+        }
+        n += iec_frame_decode(d, &c, 1, out + n);
+    }
+    *len = i;
+    return n;
+}
+
+/* Number of entries in the frames in[0..len), which starts at a frame */
+static inline size_t iec_frame_entries(const unsigned char *in, size_t len)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+    while (i < len)
+    {
+        if (in[i] < IEC_FRAME_CONTROL)
+        {
+            size_t run = (size_t)in[i] + 1;
+            n += (run < len - i - 1) ? run : len - i - 1;
+            i += run + 1;
+        }
+        else
+        {
+            if (i + IEC_FRAME_CONTROL_SIZE <= len) ++n;
+            i += IEC_FRAME_CONTROL_SIZE;
+        }
+    }
+    return n;
+}
+
+#endif /* RASPBIEC_FRAME_H */
@@ -0,0 +1,585 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include "raspbiec_listing.h"
+#include "raspbiec_utils.h"
+#include "raspbiec_exception.h"
+
+// Listing line templates, the variable parts are filled in with
+// whole-line copies. Each line is followed by padding after the
+// block count, so that the names line up like on a real drive.
+static const size_t listing_line_len = 32;
+
+static const unsigned char header_line[listing_line_len] =
+{ 0x01, 0x04, 0x01, 0x01, 0x00, 0x00, 0x12, 0x22,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x22, 0x20, 0x30, 0x30, 0x20, 0x32, 0x41, 0x00 };
+static const size_t header_name = 8;
+static const size_t header_id = 25;
+static const size_t header_id_len = 6;
+
+static const unsigned char file_line[listing_line_len] =
+{ 0x01, 0x01, 0x00, 0x00, 0x20, 0x22, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x50, 0x52, 0x47, 0x20, 0x20, 0x20, 0x20, 0x00 };
+static const size_t file_name = 6;
+static const size_t file_name_len = 16;
+static const size_t file_type = 23; // Unclosed mark, type and lock mark
+
+static const unsigned char footer_line[listing_line_len] =
+{ 0x01, 0x01, 0x00, 0x00, 0x42, 0x4C, 0x4F, 0x43,
+  0x4B, 0x53, 0x20, 0x46, 0x52, 0x45, 0x45, 0x2E,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00 };
+
+// Start a line from <tmpl> with <number> as the line number, return
+// the padding, template byte n >= 4 is at line[n + padding]
+static size_t begin_line(unsigned char *line, const unsigned char *tmpl,
+			 unsigned int number)
+{
+	size_t pad = (number < 10) ? 2 : (number < 100) ? 1 : 0;
+	memcpy(line, tmpl, 2);
+	line[2] = number % 256;
+	line[3] = number / 256;
+	memset(line + 4, 0x20, pad);
+	memcpy(line + 4 + pad, tmpl + 4, listing_line_len - 4);
+	return pad;
+}
+
+static void append_file_line(databuf_t &buf, unsigned int blocks,
+			     const unsigned char *name, size_t namelen,
+			     int filetype)
+{
+	static const unsigned char type_names[8][3] =
+	{
+		{ 0x44, 0x45, 0x4C }, // DEL
+		{ 0x53, 0x45, 0x51 }, // SEQ
+		{ 0x50, 0x52, 0x47 }, // PRG
+		{ 0x55, 0x53, 0x52 }, // USR
+		{ 0x52, 0x45, 0x4C }, // REL
+		{ 0x3F, 0x3F, 0x3F },
+		{ 0x3F, 0x3F, 0x3F },
+		{ 0x3F, 0x3F, 0x3F },
+	};
+
+	unsigned char line[listing_line_len + 2];
+	size_t pad = begin_line(line, file_line, blocks);
+	if (namelen > file_name_len) namelen = file_name_len;
+	memcpy(line + pad + file_name, name, namelen);
+	line[pad + file_name + namelen] = 0x22;
+
+	unsigned char *type = line + pad + file_type;
+	type[0] = (filetype & FILE_CLOSED) ? 0x20 : 0x2A; // '*' unclosed
+	memcpy(type + 1, type_names[filetype & 0x07], 3);
+	type[4] = (filetype & FILE_LOCKED) ? 0x3C : 0x20; // '<' locked
+	buf.insert(buf.end(), line, line + listing_line_len + pad);
+}
+
+static void append_footer_line(databuf_t &buf, unsigned int freeblocks)
+{
+	unsigned char line[listing_line_len + 2];
+	size_t pad = begin_line(line, footer_line, freeblocks);
+	buf.insert(buf.end(), line, line + listing_line_len + pad);
+}
+
+// Local files are listed as closed PRG files
+static const int local_filetype = FILE_PRG | FILE_CLOSED;
+
+// Construct a BASIC listing from the directory info
+static void render_local_dir(databuf_t &buf,
+			     const std::vector<local_dir_entry> &entries,
+			     const Diskimage::Dirfilter &filter)
+{
+	buf.insert(buf.end(), header_line, header_line + listing_line_len);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const local_dir_entry &e = entries[i];
+		if (filter.matches(e.name, local_filetype))
+			append_file_line(buf, e.blocks, e.name, e.namelen, local_filetype);
+	}
+}
+
+static unsigned int local_blocks_free(const char *dirname)
+{
+	unsigned long freeblocks = 0;
+	struct statvfs sfb;
+	if (statvfs(dirname, &sfb)==0)
+	{
+		freeblocks = sfb.f_bavail * (sfb.f_bsize/256);
+		if (freeblocks > 65535)
+			freeblocks = 65535;
+	}
+	return freeblocks;
+}
+
+// Size and type of a directory entry, false if it is not a file
+static bool stat_local_file(int dirfd, const char *name, off_t &size)
+{
+#ifdef STATX_SIZE
+	struct statx stx;
+	if (statx(dirfd, name, AT_NO_AUTOMOUNT, STATX_TYPE | STATX_SIZE, &stx) == 0)
+	{
+		size = stx.stx_size;
+		return S_ISREG(stx.stx_mode);
+	}
+	if (errno != ENOSYS)
+		return false;
+#endif
+	struct stat sb;
+	if (fstatat(dirfd, name, &sb, AT_NO_AUTOMOUNT) == -1)
+		return false;
+	size = sb.st_size;
+	return S_ISREG(sb.st_mode);
+}
+
+local_dir_scanner::local_dir_scanner(const char *dirname,
+				     const Diskimage::Dirfilter &filter) :
+		m_dirname(dirname),
+		m_filter(filter),
+		m_dir(opendir(dirname)),
+		m_next(0),
+		m_emitted(0),
+		m_started(false),
+		m_finished(false),
+		m_stop(false)
+{
+	if (m_dir == NULL)
+	{
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+
+	// Names are cheap to get, only the sizes need stat
+	struct dirent *dp;
+	while ((dp = readdir(m_dir)) != NULL)
+	{
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (dp->d_type != DT_REG && dp->d_type != DT_LNK && dp->d_type != DT_UNKNOWN)
+			continue;
+		m_names.push_back(dp->d_name);
+	}
+	std::sort(m_names.begin(), m_names.end());
+
+	m_entries.resize(m_names.size());
+	m_state.assign(m_names.size(), ENTRY_PENDING);
+	// Lines are never longer than a padded file line, so the spans
+	// handed out stay put while the listing grows
+	m_listing.reserve((m_names.size() + 2) * (listing_line_len + 2));
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	size_t workers = (m_names.size() + 63) / 64;
+	if (workers > max_workers) workers = max_workers;
+	for (size_t i = 0; i < workers; ++i)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, stat_thread, this) != 0)
+			break;
+		m_threads.push_back(thread);
+	}
+}
+
+local_dir_scanner::~local_dir_scanner()
+{
+	pthread_mutex_lock(&m_lock);
+	m_stop = true;
+	pthread_mutex_unlock(&m_lock);
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		pthread_join(m_threads[i], NULL);
+	}
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+	closedir(m_dir);
+}
+
+void *local_dir_scanner::stat_thread(void *arg)
+{
+	static_cast<local_dir_scanner *>(arg)->stat_entries();
+	return NULL;
+}
+
+// Take the next unclaimed name, -1 when there are none left
+long local_dir_scanner::claim_entry()
+{
+	long i = -1;
+	pthread_mutex_lock(&m_lock);
+	if (!m_stop && m_next < m_names.size())
+		i = m_next++;
+	pthread_mutex_unlock(&m_lock);
+	return i;
+}
+
+void local_dir_scanner::stat_entry(size_t i)
+{
+	off_t size = 0;
+	bool file = stat_local_file(dirfd(m_dir), m_names[i].c_str(), size);
+
+	local_dir_entry &e = m_entries[i];
+	e.blocks = std::min((size + 253) / 254, (off_t)65535);
+	e.host = m_names[i];
+	e.namelen = std::min(m_names[i].size(), file_name_len);
+	for (size_t j = 0; j < e.namelen; ++j)
+	{
+		e.name[j] = ascii2petscii(m_names[i][j]);
+	}
+	std::fill(e.name + e.namelen, e.name + file_name_len, 0xA0);
+
+	pthread_mutex_lock(&m_lock);
+	m_state[i] = file ? ENTRY_FILE : ENTRY_SKIP;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void local_dir_scanner::stat_entries()
+{
+	long i;
+	while ((i = claim_entry()) >= 0)
+	{
+		stat_entry(i);
+	}
+}
+
+// Render the entries, in name order, whose stat has completed
+bool local_dir_scanner::next_span(dataspan &span)
+{
+	size_t start = m_listing.size();
+	if (!m_started)
+	{
+		m_listing.insert(m_listing.end(), header_line, header_line + listing_line_len);
+		m_started = true;
+	}
+	while (m_listing.size() == start && m_emitted < m_names.size())
+	{
+		if (m_threads.empty())
+		{
+			// No pool, e.g. a small directory
+			long i = claim_entry();
+			if (i >= 0) stat_entry(i);
+		}
+		pthread_mutex_lock(&m_lock);
+		while (m_state[m_emitted] == ENTRY_PENDING)
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+		}
+		size_t ready = m_emitted;
+		while (ready < m_names.size() && m_state[ready] != ENTRY_PENDING) ++ready;
+		pthread_mutex_unlock(&m_lock);
+
+		for (; m_emitted < ready; ++m_emitted)
+		{
+			const local_dir_entry &e = m_entries[m_emitted];
+			if (m_state[m_emitted] == ENTRY_FILE && m_filter.matches(e.name, local_filetype))
+				append_file_line(m_listing, e.blocks, e.name, e.namelen, local_filetype);
+		}
+	}
+	if (m_listing.size() == start && !m_finished)
+	{
+		append_footer_line(m_listing, local_blocks_free(m_dirname.c_str()));
+		m_finished = true;
+	}
+
+	span.data = m_listing.data() + start;
+	span.len = m_listing.size() - start;
+	return span.len > 0;
+}
+
+void local_dir_scanner::files(std::vector<local_dir_entry> &entries) const
+{
+	entries.clear();
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		if (m_state[i] == ENTRY_FILE)
+			entries.push_back(m_entries[i]);
+	}
+}
+
+void read_local_dir(databuf_t &buf, const char *dirname, bool verbose,
+		    const Diskimage::Dirfilter &filter)
+{
+	size_t start = buf.size();
+	local_dir_scanner scanner(dirname, filter);
+	dataspan span;
+	while (scanner.next_span(span))
+	{
+		buf.insert(buf.end(), span.data, span.data + span.len);
+	}
+	if (verbose) basic_listing(databuf_t(buf.begin() + start, buf.end()));
+}
+
+static void render_diskimage_dir(databuf_t &buf, Diskimage& diskimage,
+				 const Diskimage::Dirfilter &filter)
+{
+	Diskimage::Dirstate dirstate;
+
+	if (!diskimage.opendir(dirstate))
+	{
+		throw raspbiec_error(IEC_DISK_IMAGE_ERROR);
+	}
+
+	// Construct a BASIC listing from the directory info
+	unsigned char line[listing_line_len];
+	memcpy(line, header_line, listing_line_len);
+	memcpy(line + header_name, dirstate.name_id, file_name_len);
+	memcpy(line + header_id, dirstate.name_id + file_name_len + 1, header_id_len);
+	for (size_t i = header_name; i < header_id + header_id_len; ++i)
+	{
+		if (line[i] == 0xA0) line[i] = 0x20;
+	}
+	buf.insert(buf.end(), line, line + listing_line_len);
+
+	std::vector<const Diskimage::Direntry *> entries;
+	diskimage.find_direntries(filter, entries);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const Diskimage::Direntry &direntry = *entries[i];
+		const unsigned char *end =
+			std::find(direntry.name, direntry.name + file_name_len, 0xA0);
+		append_file_line(buf, direntry.size_hi * 0x100 + direntry.size_lo,
+				 direntry.name, end - direntry.name, direntry.filetype);
+	}
+
+	append_footer_line(buf, dirstate.free_hi * 0x100 + dirstate.free_lo);
+}
+
+void read_diskimage_dir(
+    std::vector<unsigned char> &buf,
+    Diskimage& diskimage,
+    bool verbose,
+    const Diskimage::Dirfilter &filter)
+{
+	size_t start = buf.size();
+	render_diskimage_dir(buf, diskimage, filter);
+	if (verbose) basic_listing(databuf_t(buf.begin() + start, buf.end()));
+}
+
+dir_listing_cache::dir_listing_cache() :
+		m_kind(LISTING_NONE),
+		m_image(NULL),
+		m_generation(0),
+		m_inotify(-1),
+		m_watch(-1),
+		m_dev(0),
+		m_ino(0)
+{
+	memset(&m_mtime, 0, sizeof(m_mtime));
+	// Without inotify changes are noticed only from the directory
+	// mtime, which misses files rewritten in place
+	m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+dir_listing_cache::~dir_listing_cache()
+{
+	if (m_inotify >= 0)
+		close(m_inotify);
+}
+
+void dir_listing_cache::invalidate()
+{
+	m_kind = LISTING_NONE;
+	m_listing.clear();
+	m_entries.clear();
+	m_keys.clear();
+}
+
+// Filtered listings of an image come straight from its directory
+// index, only the complete listing is worth keeping
+void dir_listing_cache::read_diskimage_dir(databuf_t &buf, Diskimage &diskimage,
+					   const Diskimage::Dirfilter &filter)
+{
+	if (!filter.all())
+	{
+		render_diskimage_dir(buf, diskimage, filter);
+		return;
+	}
+	if (m_kind != LISTING_IMAGE || m_image != &diskimage ||
+	    m_generation != diskimage.generation())
+	{
+		invalidate();
+		render_diskimage_dir(m_listing, diskimage, filter);
+		m_kind = LISTING_IMAGE;
+		m_image = &diskimage;
+		m_generation = diskimage.generation();
+	}
+	buf.insert(buf.end(), m_listing.begin(), m_listing.end());
+}
+
+// Free blocks are not part of the cached listing, they change
+// with any write to the file system
+void dir_listing_cache::read_local_dir(databuf_t &buf, const char *dirname,
+				       const Diskimage::Dirfilter &filter)
+{
+	if (!local_dir_valid(dirname))
+		scan_local_dir(dirname);
+	if (filter.all())
+		buf.insert(buf.end(), m_listing.begin(), m_listing.end());
+	else
+		render_local_dir(buf, m_entries, filter);
+	append_footer_line(buf, local_blocks_free(dirname));
+}
+
+bool dir_listing_cache::local_dir_valid(const char *dirname)
+{
+	return m_kind == LISTING_LOCAL && !local_dir_changed(dirname);
+}
+
+void dir_listing_cache::begin_local_scan(const char *dirname)
+{
+	invalidate();
+	watch_local_dir(dirname);
+}
+
+// Lookup key of a PETSCII name, letters fold to the unshifted ones
+static void local_name_key(const unsigned char *name, size_t namelen,
+			   databuf_t &key)
+{
+	key.clear();
+	for (size_t i = 0; i < namelen && name[i] != 0xA0; ++i)
+	{
+		unsigned char c = Diskimage::normalise(name[i]);
+		if (c >= 0xC1 && c <= 0xDA) c -= 0x80;
+		key.push_back(c);
+	}
+}
+
+// Keep the files found by a completed scan
+void dir_listing_cache::end_local_scan(const local_dir_scanner &scanner)
+{
+	scanner.files(m_entries);
+	render_local_dir(m_listing, m_entries, Diskimage::Dirfilter());
+
+	databuf_t key;
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		local_name_key(m_entries[i].name, m_entries[i].namelen, key);
+		m_keys.insert(std::make_pair(key, i)); // Keeps the first one
+	}
+	m_kind = LISTING_LOCAL;
+}
+
+void dir_listing_cache::scan_local_dir(const char *dirname)
+{
+	begin_local_scan(dirname);
+	local_dir_scanner scanner(dirname, Diskimage::Dirfilter());
+	dataspan span;
+	while (scanner.next_span(span)) {}
+	end_local_scan(scanner);
+}
+
+bool dir_listing_cache::resolve_local(const char *dirname,
+				      const std::vector<unsigned char>& petsciiname,
+				      std::string &hostname)
+{
+	if (!local_dir_valid(dirname))
+		scan_local_dir(dirname);
+
+	databuf_t pattern;
+	local_name_key(petsciiname.data(), std::min(petsciiname.size(), (size_t)16), pattern);
+	if (std::find(pattern.begin(), pattern.end(), 0x2A) == pattern.end() &&
+	    std::find(pattern.begin(), pattern.end(), 0x3F) == pattern.end())
+	{
+		std::map<databuf_t, size_t>::const_iterator it = m_keys.find(pattern);
+		if (it == m_keys.end())
+			return false;
+		hostname = m_entries[it->second].host;
+		return true;
+	}
+
+	databuf_t key;
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		local_name_key(m_entries[i].name, m_entries[i].namelen, key);
+		if (Diskimage::name_matches(pattern, key.data(), key.size()))
+		{
+			hostname = m_entries[i].host;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Start watching <dirname> before it is scanned, so that anything
+// changing during the scan shows up on the next call
+void dir_listing_cache::watch_local_dir(const char *dirname)
+{
+	struct stat sb;
+	if (stat(dirname, &sb) == -1)
+	{
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
+	}
+
+	if (m_inotify >= 0)
+	{
+		if (m_watch >= 0 && (sb.st_dev != m_dev || sb.st_ino != m_ino))
+		{
+			inotify_rm_watch(m_inotify, m_watch);
+			m_watch = -1;
+		}
+		if (m_watch < 0)
+		{
+			m_watch = inotify_add_watch(m_inotify, dirname,
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+				IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+				IN_DELETE_SELF | IN_MOVE_SELF);
+		}
+		drain_events();
+	}
+	m_dev = sb.st_dev;
+	m_ino = sb.st_ino;
+	m_mtime = sb.st_mtim;
+}
+
+bool dir_listing_cache::local_dir_changed(const char *dirname)
+{
+	struct stat sb;
+	if (stat(dirname, &sb) == -1)
+		return true;
+	if (sb.st_dev != m_dev || sb.st_ino != m_ino ||
+	    sb.st_mtim.tv_sec != m_mtime.tv_sec ||
+	    sb.st_mtim.tv_nsec != m_mtime.tv_nsec)
+		return true;
+	if (m_inotify >= 0)
+		return m_watch < 0 || drain_events();
+	return false;
+}
+
+// Read away the pending inotify events, return true if there were any
+bool dir_listing_cache::drain_events()
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool any = false;
+	for (;;)
+	{
+		ssize_t rd = read(m_inotify, events, sizeof(events));
+		if (rd <= 0)
+			break;
+		any = true;
+	}
+	return any;
+}
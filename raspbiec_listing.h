@@ -0,0 +1,155 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_LISTING_H
+#define RASPBIEC_LISTING_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <dirent.h>
+#include "raspbiec_diskimage.h"
+#include "raspbiec_types.h"
+
+void read_local_dir(databuf_t &buf, const char *dirname, bool verbose,
+		    const Diskimage::Dirfilter &filter = Diskimage::Dirfilter());
+
+void read_diskimage_dir(databuf_t &buf, Diskimage& diskimage, bool verbose,
+			const Diskimage::Dirfilter &filter = Diskimage::Dirfilter());
+
+// Local file as shown in a directory listing
+struct local_dir_entry
+{
+	unsigned char name[16]; // PETSCII, padded with shift-space
+	size_t namelen;
+	unsigned int blocks;
+	std::string host; // Name in the host file system
+};
+
+// Renders a local directory listing in name order while a small
+// pool of threads gets the file sizes, so that the listing can be
+// sent as the scan goes on. Spans stay valid during the scan.
+class local_dir_scanner : public dataspan_source
+{
+public:
+	local_dir_scanner(const char *dirname, const Diskimage::Dirfilter &filter);
+	~local_dir_scanner();
+	virtual bool next_span(dataspan &span);
+	// All files found, whether listed or not, after the last span
+	void files(std::vector<local_dir_entry> &entries) const;
+	// Listing rendered so far
+	const databuf_t &listing() const { return m_listing; }
+private:
+	local_dir_scanner(const local_dir_scanner &);
+	local_dir_scanner& operator=(const local_dir_scanner &);
+
+	static void *stat_thread(void *arg);
+	void stat_entries();
+	void stat_entry(size_t i);
+	long claim_entry();
+
+	enum entry_state
+	{
+		ENTRY_PENDING,
+		ENTRY_FILE,
+		ENTRY_SKIP // Not a regular file or gone
+	};
+	static const size_t max_workers = 4;
+
+	std::string m_dirname;
+	Diskimage::Dirfilter m_filter;
+	DIR *m_dir;
+	std::vector<std::string> m_names; // Sorted
+	std::vector<local_dir_entry> m_entries; // By name index
+	std::vector<entry_state> m_state;
+	std::vector<pthread_t> m_threads;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	size_t m_next;    // First name not yet claimed by a worker
+	size_t m_emitted; // First name not yet rendered
+	databuf_t m_listing;
+	bool m_started;
+	bool m_finished;
+	bool m_stop;
+};
+
+// Rendered directory listings, kept until the directory changes.
+// The scanned files of a local directory also serve as the index
+// for finding host files by their PETSCII names.
+class dir_listing_cache
+{
+public:
+	dir_listing_cache();
+	~dir_listing_cache();
+	// Append the listing of the files selected by <filter> to <buf>
+	void read_diskimage_dir(databuf_t &buf, Diskimage &diskimage,
+				const Diskimage::Dirfilter &filter);
+	void read_local_dir(databuf_t &buf, const char *dirname,
+			    const Diskimage::Dirfilter &filter);
+	void invalidate();
+
+	// For streaming a local listing while it is scanned: a scan is
+	// needed unless local_dir_valid(), begin_local_scan() is called
+	// before the scanner is created and end_local_scan() after it
+	// has completed
+	bool local_dir_valid(const char *dirname);
+	void begin_local_scan(const char *dirname);
+	void end_local_scan(const local_dir_scanner &scanner);
+
+	// Host file in <dirname> for a PETSCII name or pattern, the first
+	// in name order wins. Case does not matter and only the first 16
+	// characters of the host name count. False if there is none.
+	bool resolve_local(const char *dirname,
+			   const std::vector<unsigned char>& petsciiname,
+			   std::string &hostname);
+private:
+	dir_listing_cache(const dir_listing_cache &);
+	dir_listing_cache& operator=(const dir_listing_cache &);
+
+	void scan_local_dir(const char *dirname);
+	void watch_local_dir(const char *dirname);
+	bool local_dir_changed(const char *dirname);
+	bool drain_events();
+
+	enum listing_kind
+	{
+		LISTING_NONE,
+		LISTING_IMAGE,
+		LISTING_LOCAL
+	};
+
+	databuf_t m_listing; // Without the footer line for local directories
+	std::vector<local_dir_entry> m_entries; // Scanned local directory
+	std::map<databuf_t, size_t> m_keys; // Folded name to first entry
+	listing_kind m_kind;
+	// Disk image listing is valid while the image generation is the same
+	const Diskimage *m_image;
+	unsigned long m_generation;
+	// Local listing is valid while the directory is the same and
+	// neither inotify nor its mtime tell about changes
+	int m_inotify;
+	int m_watch;
+	dev_t m_dev;
+	ino_t m_ino;
+	struct timespec m_mtime;
+};
+
+#endif // RASPBIEC_LISTING_H
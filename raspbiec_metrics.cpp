@@ -0,0 +1,324 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include "raspbiec_metrics.h"
+#include "raspbiec_exception.h"
+
+const double drive_metrics::bucket_bounds[num_buckets] =
+	{ 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60 };
+
+drive_metrics::histogram::histogram() :
+		count(0),
+		sum(0)
+{
+	std::fill(buckets, buckets + num_buckets, 0);
+}
+
+void drive_metrics::histogram::observe(double seconds)
+{
+	for (int i = 0; i < num_buckets; ++i)
+	{
+		if (seconds <= bucket_bounds[i]) ++buckets[i];
+	}
+	++count;
+	sum += seconds;
+}
+
+void drive_metrics::histogram::print(FILE *out, const char *name, const std::string &labels) const
+{
+	for (int i = 0; i < num_buckets; ++i)
+	{
+		fprintf(out, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels.c_str(),
+			bucket_bounds[i], buckets[i]);
+	}
+	fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels.c_str(), count);
+	fprintf(out, "%s_sum{%s} %.6f\n", name, labels.c_str(), sum);
+	fprintf(out, "%s_count{%s} %lu\n", name, labels.c_str(), count);
+}
+
+drive_metrics::drive_metrics() :
+		m_interval_s(0),
+		m_running(false),
+		m_stop(false),
+		m_start_time(time(NULL)),
+		m_cache_hits(0),
+		m_cache_misses(0),
+		m_prefetch_hits(0),
+		m_predictions(0)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+}
+
+drive_metrics::~drive_metrics()
+{
+	stop();
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void drive_metrics::start(const std::string &file, unsigned int interval_s)
+{
+	stop();
+	m_file = file;
+	m_interval_s = interval_s ? interval_s : 1;
+	if (m_file.empty())
+		return;
+	m_stop = false;
+	if (pthread_create(&m_thread, NULL, write_thread, this) != 0)
+	{
+		fprintf(stderr, "Could not start writing metrics to '%s'\n", m_file.c_str());
+		m_file.clear();
+		return;
+	}
+	m_running = true;
+}
+
+// The final values are written before returning
+void drive_metrics::stop()
+{
+	if (!m_running)
+		return;
+	pthread_mutex_lock(&m_lock);
+	m_stop = true;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(m_thread, NULL);
+	m_running = false;
+}
+
+void drive_metrics::command(const char *type)
+{
+	if (!enabled()) return;
+	pthread_mutex_lock(&m_lock);
+	++m_commands[type];
+	pthread_mutex_unlock(&m_lock);
+}
+
+void drive_metrics::error(int status)
+{
+	if (!enabled()) return;
+	pthread_mutex_lock(&m_lock);
+	++m_errors[status];
+	pthread_mutex_unlock(&m_lock);
+}
+
+void drive_metrics::request(const char *kind, bool complete, long long us, long long bus_us)
+{
+	if (!enabled()) return;
+	if (bus_us > us) bus_us = us;
+	pthread_mutex_lock(&m_lock);
+	request_metrics &r = m_requests[kind];
+	if (complete)
+		++r.served;
+	else
+		++r.incomplete;
+	r.bus.observe(bus_us / 1e6);
+	r.storage.observe((us - bus_us) / 1e6);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void drive_metrics::bus(const transfer_stats &sent, const transfer_stats &received)
+{
+	if (!enabled()) return;
+	pthread_mutex_lock(&m_lock);
+	m_sent = sent;
+	m_received = received;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void drive_metrics::cache(unsigned long hits, unsigned long misses,
+			  unsigned long prefetch_hits, unsigned long predictions)
+{
+	if (!enabled()) return;
+	pthread_mutex_lock(&m_lock);
+	m_cache_hits = hits;
+	m_cache_misses = misses;
+	m_prefetch_hits = prefetch_hits;
+	m_predictions = predictions;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void *drive_metrics::write_thread(void *arg)
+{
+	static_cast<drive_metrics *>(arg)->write_periodically();
+	return NULL;
+}
+
+void drive_metrics::write_periodically()
+{
+	pthread_mutex_lock(&m_lock);
+	while (!m_stop)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += m_interval_s;
+		while (!m_stop)
+		{
+			if (pthread_cond_timedwait(&m_cond, &m_lock, &wake) == ETIMEDOUT) break;
+		}
+		pthread_mutex_unlock(&m_lock);
+		write();
+		pthread_mutex_lock(&m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+// The collector may read the file at any time, so a complete new one
+// is renamed over it. The text is put together in memory first to
+// keep the file I/O out of the lock the service loop takes.
+void drive_metrics::write()
+{
+	char *text = NULL;
+	size_t len = 0;
+	FILE *mem = open_memstream(&text, &len);
+	if (mem == NULL)
+	{
+		fprintf(stderr, "Could not write metrics to '%s'\n", m_file.c_str());
+		return;
+	}
+	pthread_mutex_lock(&m_lock);
+	print(mem);
+	pthread_mutex_unlock(&m_lock);
+	fclose(mem);
+
+	std::string tmpname = m_file + ".XXXXXX";
+	std::vector<char> tmpl(tmpname.begin(), tmpname.end());
+	tmpl.push_back('\0');
+	int fd = mkstemp(tmpl.data());
+	if (fd < 0)
+	{
+		fprintf(stderr, "Could not write metrics to '%s'\n", m_file.c_str());
+		free(text);
+		return;
+	}
+	fchmod(fd, 0644);
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL)
+	{
+		close(fd);
+		unlink(tmpl.data());
+		free(text);
+		return;
+	}
+	bool ok = (fwrite(text, 1, len, f) == len);
+	free(text);
+	if (fclose(f) != 0 || !ok || rename(tmpl.data(), m_file.c_str()) == -1)
+	{
+		unlink(tmpl.data());
+	}
+}
+
+static void print_header(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP %s %s\n", name, help);
+	fprintf(out, "# TYPE %s %s\n", name, type);
+}
+
+// A counter of the bus for both directions
+static void print_bus(FILE *out, const char *name, const char *help,
+		      unsigned long long sent, unsigned long long received)
+{
+	print_header(out, name, "counter", help);
+	fprintf(out, "%s{direction=\"send\"} %llu\n", name, sent);
+	fprintf(out, "%s{direction=\"receive\"} %llu\n", name, received);
+}
+
+void drive_metrics::print(FILE *out)
+{
+	print_header(out, "raspbiec_drive_start_time_seconds", "gauge", "Start of the drive service");
+	fprintf(out, "raspbiec_drive_start_time_seconds %lld\n", m_start_time);
+
+	print_header(out, "raspbiec_drive_commands_total", "counter", "Bus commands by type");
+	for (std::map<std::string, unsigned long>::const_iterator i = m_commands.begin();
+	     i != m_commands.end(); ++i)
+	{
+		fprintf(out, "raspbiec_drive_commands_total{command=\"%s\"} %lu\n",
+			i->first.c_str(), i->second);
+	}
+
+	print_header(out, "raspbiec_drive_errors_total", "counter", "Errors by raspbiec status");
+	for (std::map<int, unsigned long>::const_iterator i = m_errors.begin();
+	     i != m_errors.end(); ++i)
+	{
+		std::string text(raspbiec_error(i->first).what());
+		if (!text.empty() && text[text.size()-1] == '\n')
+			text.erase(text.size()-1);
+		fprintf(out, "raspbiec_drive_errors_total{status=\"%d\",error=\"%s\"} %lu\n",
+			i->first, text.c_str(), i->second);
+	}
+
+	print_header(out, "raspbiec_drive_files_total", "counter", "File transfers by kind and outcome");
+	for (std::map<std::string, request_metrics>::const_iterator i = m_requests.begin();
+	     i != m_requests.end(); ++i)
+	{
+		fprintf(out, "raspbiec_drive_files_total{kind=\"%s\",outcome=\"complete\"} %lu\n",
+			i->first.c_str(), i->second.served);
+		fprintf(out, "raspbiec_drive_files_total{kind=\"%s\",outcome=\"incomplete\"} %lu\n",
+			i->first.c_str(), i->second.incomplete);
+	}
+
+	print_header(out, "raspbiec_drive_request_bus_seconds", "histogram",
+		     "Time of a file transfer spent on the bus");
+	for (std::map<std::string, request_metrics>::const_iterator i = m_requests.begin();
+	     i != m_requests.end(); ++i)
+	{
+		i->second.bus.print(out, "raspbiec_drive_request_bus_seconds", "kind=\"" + i->first + "\"");
+	}
+	print_header(out, "raspbiec_drive_request_storage_seconds", "histogram",
+		     "Time of a file transfer not spent on the bus, mostly storage");
+	for (std::map<std::string, request_metrics>::const_iterator i = m_requests.begin();
+	     i != m_requests.end(); ++i)
+	{
+		i->second.storage.print(out, "raspbiec_drive_request_storage_seconds", "kind=\"" + i->first + "\"");
+	}
+
+	print_bus(out, "raspbiec_drive_bus_transfers_total", "Data transfers on the bus",
+		  m_sent.transfers, m_received.transfers);
+	print_bus(out, "raspbiec_drive_bus_failed_transfers_total", "Data transfers ended by an error",
+		  m_sent.failed, m_received.failed);
+	print_bus(out, "raspbiec_drive_bus_bytes_total", "Bytes moved on the bus",
+		  m_sent.bytes, m_received.bytes);
+	print_header(out, "raspbiec_drive_bus_seconds_total", "counter", "Time spent in data transfers");
+	fprintf(out, "raspbiec_drive_bus_seconds_total{direction=\"send\"} %.6f\n", m_sent.us / 1e6);
+	fprintf(out, "raspbiec_drive_bus_seconds_total{direction=\"receive\"} %.6f\n", m_received.us / 1e6);
+	print_bus(out, "raspbiec_drive_bus_syscalls_total", "Reads and writes of the bus",
+		  m_sent.reads + m_sent.writes, m_received.reads + m_received.writes);
+	print_bus(out, "raspbiec_drive_bus_waits_total", "Waits for the bus to become ready",
+		  m_sent.waits, m_received.waits);
+	print_bus(out, "raspbiec_drive_bus_retries_total", "Bus writes which had to be repeated",
+		  m_sent.retries, m_received.retries);
+	print_bus(out, "raspbiec_drive_bus_byte_errors_total", "Bytes flagged by IEC_PREV_BYTE_HAS_ERROR",
+		  m_sent.byte_errors, m_received.byte_errors);
+
+	print_header(out, "raspbiec_drive_cache_hits_total", "counter", "Loads served from the file cache");
+	fprintf(out, "raspbiec_drive_cache_hits_total %lu\n", m_cache_hits);
+	print_header(out, "raspbiec_drive_cache_misses_total", "counter", "Loads not found in the file cache");
+	fprintf(out, "raspbiec_drive_cache_misses_total %lu\n", m_cache_misses);
+	print_header(out, "raspbiec_drive_prefetch_predictions_total", "counter", "Files read ahead for a predicted load");
+	fprintf(out, "raspbiec_drive_prefetch_predictions_total %lu\n", m_predictions);
+	print_header(out, "raspbiec_drive_prefetch_hits_total", "counter", "Predicted loads which happened");
+	fprintf(out, "raspbiec_drive_prefetch_hits_total %lu\n", m_prefetch_hits);
+}
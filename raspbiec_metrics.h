@@ -0,0 +1,121 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_METRICS_H
+#define RASPBIEC_METRICS_H
+
+#include <cstdio>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include "raspbiec_device.h"
+
+// Drive service counters, written in the Prometheus text format to a
+// file for the node exporter textfile collector. A background thread
+// replaces the file every interval and once more when stopped, so it
+// always holds a complete set of metrics. Without a file name nothing
+// is collected.
+class drive_metrics
+{
+public:
+	drive_metrics();
+	~drive_metrics();
+	void start(const std::string &file, unsigned int interval_s);
+	void stop();
+	bool enabled() const { return !m_file.empty(); }
+
+	void command(const char *type);
+	void error(int status);
+	// A file transfer of the given kind, with the part spent on the bus
+	void request(const char *kind, bool complete, long long us, long long bus_us);
+	void bus(const transfer_stats &sent, const transfer_stats &received);
+	void cache(unsigned long hits, unsigned long misses,
+		   unsigned long prefetch_hits, unsigned long predictions);
+private:
+	drive_metrics(const drive_metrics &);
+	drive_metrics& operator=(const drive_metrics &);
+
+	enum { num_buckets = 10 };
+	static const double bucket_bounds[num_buckets]; // Seconds
+
+	struct histogram
+	{
+		histogram();
+		void observe(double seconds);
+		void print(FILE *out, const char *name, const std::string &labels) const;
+		unsigned long buckets[num_buckets];
+		unsigned long count;
+		double sum;
+	};
+	struct request_metrics
+	{
+		request_metrics() : served(0), incomplete(0) {}
+		unsigned long served;
+		unsigned long incomplete;
+		histogram bus;
+		histogram storage;
+	};
+
+	static void *write_thread(void *arg);
+	void write_periodically();
+	void write();
+	void print(FILE *out);
+
+	std::string m_file;
+	unsigned int m_interval_s;
+	bool m_running;
+	bool m_stop;
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	long long m_start_time;
+
+	std::map<std::string, unsigned long> m_commands;
+	std::map<int, unsigned long> m_errors;
+	std::map<std::string, request_metrics> m_requests;
+	transfer_stats m_sent;
+	transfer_stats m_received;
+	unsigned long m_cache_hits;
+	unsigned long m_cache_misses;
+	unsigned long m_prefetch_hits;
+	unsigned long m_predictions;
+};
+
+// Splits the time of one file transfer into the time the device
+// spent on the bus and the rest
+class request_timer
+{
+public:
+	explicit request_timer(const device &dev) :
+		m_dev(dev), m_start(monotonic_us()), m_bus_start(bus_us(dev)) {}
+	void done(drive_metrics &metrics, const char *kind, bool complete) const
+	{
+		metrics.request(kind, complete, monotonic_us() - m_start,
+				bus_us(m_dev) - m_bus_start);
+	}
+private:
+	static long long bus_us(const device &dev)
+	{
+		return dev.all_sent().us + dev.all_received().us;
+	}
+	const device &m_dev;
+	long long m_start;
+	long long m_bus_start;
+};
+
+#endif // RASPBIEC_METRICS_H
@@ -0,0 +1,347 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <algorithm>
+#include "raspbiec_prefetch.h"
+#include "raspbiec_filecache.h"
+#include "raspbiec_utils.h"
+
+static std::string hex_name(const databuf_t &name)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (size_t i = 0; i < name.size(); ++i)
+	{
+		hex += digits[name[i] >> 4];
+		hex += digits[name[i] & 0x0f];
+	}
+	return hex;
+}
+
+static bool unhex_name(const std::string &hex, databuf_t &name)
+{
+	name.clear();
+	if (hex.size() % 2 != 0)
+		return false;
+	for (size_t i = 0; i < hex.size(); i += 2)
+	{
+		unsigned int c;
+		if (sscanf(hex.c_str() + i, "%2x", &c) != 1)
+			return false;
+		name.push_back(c);
+	}
+	return true;
+}
+
+load_history::load_history() :
+		m_have_last(false),
+		m_dirty(false),
+		m_saved_ms(0)
+{
+}
+
+load_history::~load_history()
+{
+	flush();
+}
+
+// One line per transition: context, previous and next name in hex, count
+void load_history::open(const std::string &file, const std::string &context)
+{
+	flush();
+	m_next.clear();
+	m_other.clear();
+	m_file = file;
+	m_context = context;
+	m_have_last = false;
+	m_saved_ms = monotonic_ms();
+	if (m_file.empty())
+		return;
+
+	FILE *f = fopen(m_file.c_str(), "r");
+	if (f == NULL)
+		return;
+	char line[1024];
+	while (fgets(line, sizeof line, f) != NULL)
+	{
+		std::string l(line);
+		if (!l.empty() && l[l.size()-1] == '\n') l.erase(l.size()-1);
+		size_t t1 = l.find('\t');
+		size_t t2 = (t1 == std::string::npos) ? t1 : l.find('\t', t1+1);
+		size_t t3 = (t2 == std::string::npos) ? t2 : l.find('\t', t2+1);
+		if (t3 == std::string::npos)
+			continue;
+		if (l.compare(0, t1, m_context) != 0)
+		{
+			m_other.push_back(l);
+			continue;
+		}
+		databuf_t prev, next;
+		if (unhex_name(l.substr(t1+1, t2-t1-1), prev) &&
+		    unhex_name(l.substr(t2+1, t3-t2-1), next))
+		{
+			m_next[prev][next] += strtoul(l.c_str() + t3 + 1, NULL, 10);
+		}
+	}
+	fclose(f);
+}
+
+void load_history::loaded(const databuf_t &name)
+{
+	if (m_have_last && m_last != name)
+	{
+		++m_next[m_last][name];
+		m_dirty = true;
+		// Keep the file I/O out of a run of loads
+		if (monotonic_ms() - m_saved_ms >= 60000)
+			flush();
+	}
+	m_last = name;
+	m_have_last = true;
+}
+
+bool load_history::predict(databuf_t &name) const
+{
+	if (!m_have_last)
+		return false;
+	std::map<databuf_t, successors>::const_iterator it = m_next.find(m_last);
+	if (it == m_next.end())
+		return false;
+
+	unsigned long best = 0;
+	for (successors::const_iterator s = it->second.begin(); s != it->second.end(); ++s)
+	{
+		if (s->second > best)
+		{
+			best = s->second;
+			name = s->first;
+		}
+	}
+	return best > 0;
+}
+
+void load_history::flush()
+{
+	if (m_dirty)
+	{
+		save();
+		m_dirty = false;
+		m_saved_ms = monotonic_ms();
+	}
+}
+
+// Written to a temporary file first, so that a crash never
+// leaves a half written history behind
+void load_history::save()
+{
+	if (m_file.empty())
+		return;
+
+	std::string tmpname = m_file + ".XXXXXX";
+	std::vector<char> tmpl(tmpname.begin(), tmpname.end());
+	tmpl.push_back('\0');
+	int fd = mkstemp(tmpl.data());
+	if (fd < 0)
+	{
+		fprintf(stderr, "Could not save load history '%s'\n", m_file.c_str());
+		m_file.clear(); // Do not try again on every load
+		return;
+	}
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL)
+	{
+		close(fd);
+		unlink(tmpl.data());
+		return;
+	}
+	for (size_t i = 0; i < m_other.size(); ++i)
+	{
+		fprintf(f, "%s\n", m_other[i].c_str());
+	}
+	for (std::map<databuf_t, successors>::const_iterator p = m_next.begin(); p != m_next.end(); ++p)
+	{
+		for (successors::const_iterator n = p->second.begin(); n != p->second.end(); ++n)
+		{
+			fprintf(f, "%s\t%s\t%s\t%lu\n", m_context.c_str(),
+				hex_name(p->first).c_str(), hex_name(n->first).c_str(), n->second);
+		}
+	}
+	if (fclose(f) != 0 || rename(tmpl.data(), m_file.c_str()) == -1)
+	{
+		unlink(tmpl.data());
+	}
+}
+
+local_file_prefetch::local_file_prefetch() :
+		m_running(false),
+		m_done(false),
+		m_cancel(false),
+		m_limit(0),
+		m_chain_fd(-1),
+		m_track(0),
+		m_sector(0),
+		m_ok(false)
+{
+}
+
+local_file_prefetch::~local_file_prefetch()
+{
+	m_cancel = true;
+	join();
+}
+
+void local_file_prefetch::start(const std::string &name, size_t limit)
+{
+	m_cancel = true;
+	join();
+	m_name = name;
+	m_limit = limit;
+	run(read_thread);
+}
+
+void local_file_prefetch::start_chain(int fd, const image_layout &layout, int track, int sector)
+{
+	m_cancel = true;
+	join();
+	// A copy of its own, the image may be closed meanwhile
+	m_chain_fd = dup(fd);
+	if (m_chain_fd < 0)
+		return;
+	m_layout = layout;
+	m_track = track;
+	m_sector = sector;
+	run(chain_thread);
+}
+
+void local_file_prefetch::run(void *(*thread)(void *))
+{
+	m_ok = false;
+	m_done = false;
+	m_cancel = false;
+	m_running = (pthread_create(&m_thread, NULL, thread, this) == 0);
+	if (!m_running && m_chain_fd >= 0)
+	{
+		close(m_chain_fd);
+		m_chain_fd = -1;
+	}
+}
+
+bool local_file_prefetch::take(std::string &key, std::string &version, databuf_t &data)
+{
+	if (m_running && !m_done)
+	{
+		// Joined by the next start()
+		m_cancel = true;
+		return false;
+	}
+	__sync_synchronize(); // Read the results only after m_done
+	join();
+	if (!m_ok)
+		return false;
+	m_ok = false;
+	key = m_key;
+	version = m_version;
+	data.swap(m_data);
+	databuf_t().swap(m_data);
+	return true;
+}
+
+void local_file_prefetch::join()
+{
+	if (m_running)
+	{
+		pthread_join(m_thread, NULL);
+		m_running = false;
+	}
+}
+
+void *local_file_prefetch::read_thread(void *arg)
+{
+	local_file_prefetch *self = static_cast<local_file_prefetch *>(arg);
+	self->read_file();
+	__sync_synchronize(); // Publish the results before m_done
+	self->m_done = true;
+	return NULL;
+}
+
+void *local_file_prefetch::chain_thread(void *arg)
+{
+	local_file_prefetch *self = static_cast<local_file_prefetch *>(arg);
+	self->read_chain();
+	__sync_synchronize();
+	self->m_done = true;
+	return NULL;
+}
+
+// The links are read from the file, which the image flushes its
+// changes to. A link not flushed yet only makes this read the
+// wrong blocks.
+void local_file_prefetch::read_chain()
+{
+	size_t blocks = 0;
+	for (size_t t = 0; t < m_layout.size(); ++t)
+		blocks += m_layout[t].sectors;
+
+	unsigned char link[2];
+	while (!m_cancel && blocks-- > 0 &&
+	       m_track > 0 && (size_t)m_track < m_layout.size() &&
+	       m_sector >= 0 && m_sector < m_layout[m_track].sectors)
+	{
+		off_t offset = 0x100 * (off_t)(m_layout[m_track].first_block + m_sector);
+		posix_fadvise(m_chain_fd, offset, 0x100, POSIX_FADV_WILLNEED);
+		if (pread(m_chain_fd, link, sizeof link, offset) != (ssize_t)sizeof link)
+			break;
+		m_track = link[0];
+		m_sector = link[1];
+	}
+	close(m_chain_fd);
+	m_chain_fd = -1;
+}
+
+// Read in pieces to notice a cancel soon
+static const size_t prefetch_chunk = 65536;
+
+void local_file_prefetch::read_file()
+{
+	int fd = ::open(m_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct stat sb;
+	if (local_file_identity(fd, m_key, m_version) &&
+	    fstat(fd, &sb) == 0 && (size_t)sb.st_size <= m_limit)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		m_data.resize(sb.st_size);
+		size_t got = 0;
+		ssize_t rd = 1;
+		while (got < m_data.size() && rd > 0 && !m_cancel)
+		{
+			rd = read(fd, m_data.data() + got,
+					std::min(m_data.size() - got, prefetch_chunk));
+			if (rd > 0) got += rd;
+		}
+		m_ok = (got == m_data.size() && !m_cancel);
+	}
+	close(fd);
+}
@@ -0,0 +1,101 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_PREFETCH_H
+#define RASPBIEC_PREFETCH_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include "raspbiec_types.h"
+
+// Which file tends to be loaded after which, learned per disk image
+// or directory and kept in a history file between sessions
+class load_history
+{
+public:
+	load_history();
+	~load_history();
+	// Read the history of <context> from <file>, an empty name
+	// keeps the history in memory only
+	void open(const std::string &file, const std::string &context);
+	// Record a completed load. A change is written to the file at
+	// most once a minute, the rest by flush() or at destruction.
+	void loaded(const databuf_t &name);
+	void flush();
+	// Most frequent successor of the last loaded file
+	bool predict(databuf_t &name) const;
+private:
+	void save();
+
+	typedef std::map<databuf_t, unsigned long> successors;
+	std::map<databuf_t, successors> m_next;
+	std::vector<std::string> m_other; // Lines of other contexts
+	std::string m_file;
+	std::string m_context;
+	databuf_t m_last;
+	bool m_have_last;
+	bool m_dirty;
+	long long m_saved_ms;
+};
+
+// Reads a local file into memory, or a file of a disk image into
+// the page cache, in a background thread
+class local_file_prefetch
+{
+public:
+	local_file_prefetch();
+	~local_file_prefetch();
+	// Start reading <name> up to <limit> bytes, dropping any earlier read
+	void start(const std::string &name, size_t limit);
+	// Start following the sector chain from <track>/<sector> in the
+	// disk image file <fd>. Nothing is kept, the blocks are only
+	// brought to the page cache for the mapping of the image.
+	void start_chain(int fd, const image_layout &layout, int track, int sector);
+	// The finished read, false if there was none or it failed.
+	// A read still in progress is cancelled instead of waited for.
+	bool take(std::string &key, std::string &version, databuf_t &data);
+private:
+	local_file_prefetch(const local_file_prefetch &);
+	local_file_prefetch& operator=(const local_file_prefetch &);
+
+	void run(void *(*thread)(void *));
+	static void *read_thread(void *arg);
+	void read_file();
+	static void *chain_thread(void *arg);
+	void read_chain();
+	void join();
+
+	pthread_t m_thread;
+	bool m_running;
+	volatile bool m_done; // Set by the thread as its last access
+	volatile bool m_cancel;
+	std::string m_name;
+	size_t m_limit;
+	int m_chain_fd;
+	image_layout m_layout;
+	int m_track;
+	int m_sector;
+	bool m_ok;
+	std::string m_key;
+	std::string m_version;
+	databuf_t m_data;
+};
+
+#endif // RASPBIEC_PREFETCH_H
@@ -0,0 +1,531 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include "raspbiec_transport.h"
+#include "raspbiec_utils.h"
+#include "raspbiec_exception.h"
+
+const char* raspbiecdevname = "/dev/raspbiec";
+
+/* Virtual bus between the drive and computer processes:
+ * one lock-free single producer/single consumer ring per direction
+ * in a shared mapping. The producer only advances head, the consumer
+ * only advances tail. A side that finds its ring empty (or full)
+ * raises its waiting flag and sleeps on the futex of the other
+ * index; the other side wakes it only if the flag is up.
+ */
+#define IEC_RING_SIZE 8192 /* entries, power of two */
+#define IEC_RING_MASK (IEC_RING_SIZE-1)
+#define IEC_RING_LIVENESS_MS 100 /* Check for a dead peer this often */
+
+struct iec_ring
+{
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t reader_waiting;
+	volatile uint32_t writer_waiting;
+	volatile uint32_t closed;
+	int16_t data[IEC_RING_SIZE];
+};
+
+struct iec_ring_pair
+{
+	volatile int refs; // Ends sharing the mapping in this process
+	iec_ring ring[2]; // [0] A to B, [1] B to A
+};
+
+static int futex_wait(volatile uint32_t *addr, uint32_t val, long timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(volatile uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+pipefd::pipefd() :
+		m_fd_size(1),
+		m_ring(NULL),
+		m_ring_side(-1),
+		m_format(IEC_FORMAT_INT16)
+{
+	for (int i=0; i<4; ++i) m_fd[i] = -1;
+	iec_frame_decoder_init(&m_decoder);
+}
+
+pipefd::~pipefd()
+{
+	close_pipe();
+}
+
+void pipefd::move(pipefd &other)
+{
+	close_pipe();
+	for (int i=0; i<4; ++i) m_fd[i] = other.m_fd[i];
+	m_fd_size = other.m_fd_size;
+	m_ring = other.m_ring;
+	m_ring_side = other.m_ring_side;
+	m_format = other.m_format;
+	m_decoder = other.m_decoder;
+	for (int i=0; i<4; ++i) other.m_fd[i] = -1;
+	other.m_fd_size = 1;
+	other.m_ring = NULL;
+	other.m_ring_side = -1;
+	other.m_format = IEC_FORMAT_INT16;
+}
+
+void pipefd::close_pipe()
+{
+	if (m_ring)
+	{
+		// Let the other end see EOF (or EPIPE)
+		for (int i=0; i<2; ++i)
+		{
+			m_ring->ring[i].closed = 1;
+			__sync_synchronize();
+			futex_wake(&m_ring->ring[i].head);
+			futex_wake(&m_ring->ring[i].tail);
+		}
+		// After a fork each process has its own mapping to drop,
+		// in-process rings share one mapping between both ends
+		if (m_fd_size != 0 || __sync_sub_and_fetch(&m_ring->refs, 1) == 0)
+		{
+			munmap(m_ring, sizeof *m_ring);
+		}
+		m_ring = NULL;
+		m_ring_side = -1;
+	}
+	for (int i=0; i<m_fd_size; ++i)
+	{
+		if (m_fd[i] >= 0) ::close(m_fd[i]);
+	}
+	for (int i=0; i<4; ++i)
+	{
+		m_fd[i] = -1;
+	}
+	m_fd_size = 1;
+	m_format = IEC_FORMAT_INT16;
+	iec_frame_decoder_init(&m_decoder);
+}
+
+void pipefd::open_pipe()
+{
+	close_pipe();
+    m_fd_size = 4;
+    if (pipe(&m_fd[0]) == -1 ||
+    	pipe(&m_fd[2]) == -1)
+    {
+    	close_pipe();
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+    }
+    // Both ends are ours, no need to negotiate
+    m_format = IEC_FORMAT_FRAMED;
+}
+
+void pipefd::open_ring()
+{
+	open_pipe();
+	void *mem = mmap(NULL, sizeof(iec_ring_pair), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		return; // Plain pipes work too, just slower
+	}
+	// Anonymous memory is zeroed, i.e. both rings are empty
+	m_ring = (iec_ring_pair *)mem;
+	m_format = IEC_FORMAT_INT16;
+}
+
+void pipefd::open_local(pipefd &peer)
+{
+	close_pipe();
+	peer.close_pipe();
+	void *mem = mmap(NULL, sizeof(iec_ring_pair), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+	}
+	m_ring = (iec_ring_pair *)mem;
+	m_ring->refs = 2; // One for each end
+	m_fd_size = 0;
+	m_ring_side = 0;
+	peer.m_ring = m_ring;
+	peer.m_fd_size = 0;
+	peer.m_ring_side = 1;
+}
+
+void pipefd::open_dev()
+{
+	close_pipe();
+	int fd_dev = open(raspbiecdevname, O_RDWR);
+	if (fd_dev < 0)
+	{
+		int deverr = errno;
+		fprintf(stderr,"Cannot open %s\n",raspbiecdevname);
+		if (deverr == EREMOTEIO)
+			throw raspbiec_error(IEC_BUS_NOT_IDLE);
+		else
+			throw raspbiec_error(IEC_DRIVER_NOT_PRESENT);
+	}
+	m_fd[0] = fd_dev;
+
+	// Use the compact stream format if the kernel module knows it,
+	// older modules reject the ioctl and talk int16_t
+	int format = IEC_FORMAT_FRAMED;
+	if (ioctl(fd_dev, RASPBIEC_IOC_SET_FORMAT, &format) == 0)
+	{
+		m_format = IEC_FORMAT_FRAMED;
+	}
+}
+
+bool pipefd::is_open_directional()
+{
+	if (0 == m_fd_size) // in-process rings
+	{
+		return (m_ring != NULL);
+	}
+	if (is_device()) // bidirectional
+	{
+		return (m_fd[0] >= 0);
+	}
+	// two unidirectional pipes, 0 and 3 or 1 and 2
+	if (m_fd[0] >= 0 && m_fd[1] < 0 && m_fd[2] < 0 && m_fd[3] >= 0) return true;
+	if (m_fd[0] < 0 && m_fd[1] >= 0 && m_fd[2] >= 0 && m_fd[3] < 0) return true;
+	return false;
+}
+
+bool pipefd::is_open_nondirectional()
+{
+	for (int i=0; i<m_fd_size; ++i) if (m_fd[i] < 0) return false;
+	return true;
+}
+
+bool pipefd::is_device()
+{
+    return 1 == m_fd_size;
+}
+
+void pipefd::set_write(int *fd)
+{
+	if (fd[0] >= 0)
+	{
+		close(fd[0]); // Close unused read end
+		fd[0] = -1;
+	}
+	if (fd[1] < 0) // Check write end is open
+	{
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+	}
+}
+
+void pipefd::set_read(int *fd)
+{
+	if (fd[1] >= 0)
+	{
+		close(fd[1]); // Close unused write end
+		fd[1] = -1;
+	}
+	if (fd[0] < 0) // Check read end is open
+	{
+		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+	}
+}
+
+void pipefd::set_direction(bool fwd)
+{
+	if (!is_device()) // two unidirectional pipes
+	{
+		if (fwd) // these directions are arbitrary
+		{
+			set_write(&m_fd[0]);
+			set_read(&m_fd[2]);
+		}
+		else
+		{
+			set_read(&m_fd[0]);
+			set_write(&m_fd[2]);
+		}
+		if (m_ring)
+		{
+			m_ring_side = fwd ? 0 : 1;
+		}
+	}
+}
+
+int pipefd::write_end()
+{
+	if (!is_open_directional()) throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+
+	if (is_device()) // bidirectional
+	{
+		return m_fd[0];
+	}
+	// two unidirectional pipes
+	return (m_fd[1] >= 0) ? m_fd[1] : m_fd[3];
+}
+
+int pipefd::read_end()
+{
+	if (!is_open_directional()) throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+
+	if (is_device()) // bidirectional
+	{
+		return m_fd[0];
+	}
+	// two unidirectional pipes
+	return (m_fd[0] >= 0) ? m_fd[0] : m_fd[2];
+}
+
+ssize_t pipefd::read_bus(int16_t *buf, size_t count)
+{
+	if (m_ring)
+	{
+		iec_ring &r = m_ring->ring[1 - m_ring_side];
+		uint32_t tail = r.tail;
+		uint32_t avail;
+		while ((avail = r.head - tail) == 0)
+		{
+			if (r.closed) return 0; // EOF
+			if (wait_bus(false, -1) < 0) return -1;
+		}
+		__sync_synchronize(); // Read data only after head
+		if (count > avail) count = avail;
+		for (size_t i = 0; i < count; ++i)
+		{
+			buf[i] = r.data[(tail + i) & IEC_RING_MASK];
+		}
+		__sync_synchronize();
+		r.tail = tail + count;
+		__sync_synchronize();
+		if (r.writer_waiting)
+		{
+			r.writer_waiting = 0;
+			futex_wake(&r.tail);
+		}
+		return count;
+	}
+
+	if (m_format == IEC_FORMAT_FRAMED)
+	{
+		// Each frame byte yields at most one entry
+		for (;;)
+		{
+			unsigned char *frame = (unsigned char *)buf + count;
+			ssize_t ret = read(read_end(), frame, count);
+			if (ret <= 0) return ret;
+			// Decode in place, the entries never overtake the
+			// unread frame bytes in the upper half of buf
+			long n = iec_frame_decode(&m_decoder, frame, ret, buf);
+			if (n < 0)
+			{
+				errno = EPROTO;
+				return -1;
+			}
+			if (n > 0) return n;
+			// Only part of a frame header was read, wait for the rest
+		}
+	}
+
+	ssize_t ret = read(read_end(), buf, count * sizeof *buf);
+	if (ret > 0 && (ret % sizeof *buf) != 0)
+	{
+		// A pipe may split an entry between reads, get the rest of it
+		char *p = (char *)buf + ret;
+		ssize_t rest = sizeof *buf - (ret % sizeof *buf);
+		while (rest > 0)
+		{
+			ssize_t r = read(read_end(), p, rest);
+			if (r <= 0) return r;
+			p += r;
+			rest -= r;
+			ret += r;
+		}
+	}
+	return (ret > 0) ? (ssize_t)(ret / sizeof *buf) : ret;
+}
+
+ssize_t pipefd::write_bus(const int16_t *buf, size_t count)
+{
+	if (count > max_transfer()) count = max_transfer();
+
+	if (m_ring)
+	{
+		// Blocks until all is written, like a pipe
+		iec_ring &r = m_ring->ring[m_ring_side];
+		uint32_t head = r.head;
+		size_t done = 0;
+		while (done < count)
+		{
+			uint32_t room;
+			while ((room = IEC_RING_SIZE - (head - r.tail)) == 0 && !r.closed)
+			{
+				if (wait_bus(true, -1) < 0) return (done > 0) ? (ssize_t)done : -1;
+			}
+			if (r.closed)
+			{
+				errno = EPIPE;
+				return (done > 0) ? (ssize_t)done : -1;
+			}
+			__sync_synchronize(); // Overwrite data only after tail
+			size_t n = std::min((size_t)room, count - done);
+			for (size_t i = 0; i < n; ++i)
+			{
+				r.data[(head + i) & IEC_RING_MASK] = buf[done + i];
+			}
+			__sync_synchronize(); // Publish data before head
+			head += n;
+			r.head = head;
+			done += n;
+			__sync_synchronize();
+			if (r.reader_waiting)
+			{
+				r.reader_waiting = 0;
+				futex_wake(&r.head);
+			}
+		}
+		return done;
+	}
+
+	if (m_format == IEC_FORMAT_FRAMED)
+	{
+		size_t done = 0;
+		while (done < count)
+		{
+			size_t n = count - done;
+			size_t len = iec_frame_encode(buf + done, &n,
+					m_frame, is_device() ? sizeof m_frame : PIPE_BUF);
+			ssize_t ret = write(write_end(), m_frame, len);
+			if (is_device())
+			{
+				// Device returns the bytes up to the last entry sent to bus
+				return (ret < 0) ? ret : (ssize_t)iec_frame_entries(m_frame, ret);
+			}
+			if (ret < 0)
+			{
+				return (done > 0) ? (ssize_t)done : ret;
+			}
+			done += n;
+		}
+		return done;
+	}
+
+	ssize_t ret = write(write_end(), buf, count * sizeof *buf);
+	if (is_device() || ret <= 0)
+	{
+		return ret; // Device returns the number of entries sent to bus
+	}
+	return ret / sizeof *buf;
+}
+
+size_t pipefd::max_transfer()
+{
+	if (m_ring)
+	{
+		return IEC_RING_SIZE;
+	}
+	if (is_device())
+	{
+		return RASPBIEC_WRITE_FIFO_SIZE;
+	}
+	// Pipe writes up to PIPE_BUF are atomic
+	return PIPE_BUF / sizeof(int16_t);
+}
+
+bool pipefd::ring_ready(bool for_write)
+{
+	if (for_write)
+	{
+		iec_ring &r = m_ring->ring[m_ring_side];
+		return r.closed || r.head - r.tail < IEC_RING_SIZE;
+	}
+	iec_ring &r = m_ring->ring[1 - m_ring_side];
+	return r.closed || r.head != r.tail;
+}
+
+// The other process may die without closing the rings,
+// but the kernel closes its pipe ends in any case
+bool pipefd::peer_gone()
+{
+	if (0 == m_fd_size)
+	{
+		return false; // A thread always closes its end when done
+	}
+	struct pollfd pfd;
+	pfd.fd = read_end();
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+int pipefd::wait_bus(bool for_write, long timeout_ms)
+{
+	if (m_ring)
+	{
+		iec_ring &r = m_ring->ring[for_write ? m_ring_side : 1 - m_ring_side];
+		volatile uint32_t *index = for_write ? &r.tail : &r.head;
+		volatile uint32_t *waiting = for_write ? &r.writer_waiting : &r.reader_waiting;
+		const long long deadline = (timeout_ms < 0) ? -1 : monotonic_ms() + timeout_ms;
+		for (;;)
+		{
+			*waiting = 1;
+			__sync_synchronize();
+			uint32_t seen = *index;
+			if (ring_ready(for_write)) return 1;
+			if (peer_gone())
+			{
+				r.closed = 1;
+				return 1;
+			}
+			long slice = IEC_RING_LIVENESS_MS;
+			if (deadline >= 0)
+			{
+				long long left = deadline - monotonic_ms();
+				if (left <= 0) return 0;
+				if (left < slice) slice = left;
+			}
+			if (futex_wait(index, seen, slice) == -1 && errno == EINTR)
+			{
+				return -1;
+			}
+		}
+	}
+
+	struct pollfd pfd;
+	pfd.fd = for_write ? write_end() : read_end();
+	pfd.events = for_write ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	// Errors and hangups are reported as readiness,
+	// the following read or write will pick them up
+	return poll(&pfd, 1, (timeout_ms < 0) ? -1 : (int)timeout_ms);
+}
@@ -0,0 +1,86 @@
+/*
+ * Raspbiec - Commodore 64 & 1541 serial bus handler for Raspberry Pi
+ * Copyright (C) 2013 Antti Paarlahti <antti.paarlahti@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RASPBIEC_TRANSPORT_H
+#define RASPBIEC_TRANSPORT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "raspbiec_common.h"
+#include "raspbiec_frame.h"
+
+struct iec_ring_pair;
+
+// Bus device node of the kernel module
+extern const char* raspbiecdevname;
+
+class pipefd
+{
+public:
+	pipefd();
+	~pipefd();
+	void move(pipefd &other);
+	void open_pipe();
+	// Shared memory rings for the virtual bus, falls back to pipes
+	void open_ring();
+	// In-process rings between two threads, this end is A and peer is B
+	void open_local(pipefd &peer);
+	void open_dev();
+	void close_pipe();
+	bool is_open_directional();
+	bool is_open_nondirectional();
+	bool is_device();
+	bool is_ring() { return m_ring != NULL; }
+	int write_end();
+	int read_end();
+	void set_direction_A_to_B() { set_direction(true); }
+	void set_direction_B_to_A() { set_direction(false); }
+	// Transfer bus entries (data bytes or control codes) in bulk.
+	// Return the number of entries transferred or -1 (errno is set)
+	ssize_t read_bus(int16_t *buf, size_t count);
+	ssize_t write_bus(const int16_t *buf, size_t count);
+	// Maximum number of entries one write_bus() call can take
+	size_t max_transfer();
+	// Wait until the bus can be read from (or written to)
+	// Return >0 when ready, 0 on timeout, -1 on error (errno is set)
+	// timeout_ms < 0 waits forever
+	int wait_bus(bool for_write, long timeout_ms);
+	int format() { return m_format; }
+private:
+	bool all_open();
+	void set_write(int *fd);
+	void set_read(int *fd);
+	void set_direction(bool fwd);
+	bool ring_ready(bool for_write);
+	bool peer_gone();
+
+	int m_fd[4];
+	int m_fd_size; // 1 == dev, 4 == two pipes, 0 == in-process rings
+
+	// Virtual bus rings, the pipes are then only
+	// used for noticing when the other end goes away
+	iec_ring_pair *m_ring;
+	int m_ring_side; // Index of the ring written to, -1 == not set
+
+	// Stream format, IEC_FORMAT_INT16 or IEC_FORMAT_FRAMED
+	int m_format;
+	iec_frame_decoder m_decoder;
+	unsigned char m_frame[IEC_FRAME_MAX_SIZE(RASPBIEC_WRITE_FIFO_SIZE)];
+};
+
+#endif // RASPBIEC_TRANSPORT_H
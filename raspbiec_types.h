@@ -8,11 +8,103 @@
 #ifndef RASPBIEC_TYPES_H
 #define RASPBIEC_TYPES_H
 
+#include <cstddef>
 #include <vector>
+#include <iterator>
 
 typedef std::vector<unsigned char> databuf_t;
 typedef databuf_t::iterator databuf_iter;
 typedef databuf_t::const_iterator const_databuf_iter;
 typedef std::back_insert_iterator<databuf_t> databuf_back_insert;
 
+// A contiguous piece of data, e.g. the data part of a disk image sector
+struct dataspan
+{
+	const unsigned char *data;
+	size_t len;
+};
+
+// Where the blocks of each track are in a disk image file,
+// indexed by track number
+struct image_track
+{
+	size_t first_block;
+	int sectors;
+};
+typedef std::vector<image_track> image_layout;
+
+// Hands out data one span at a time, e.g. a file being sent to the bus
+class dataspan_source
+{
+public:
+	virtual ~dataspan_source() {}
+	// Return false when there is no more data. A span stays valid
+	// until next_span() has been called two more times.
+	virtual bool next_span(dataspan &span) = 0;
+};
+
+// Scatter/gather list of spans known up front
+typedef std::vector<dataspan> dataspan_list;
+
+class dataspan_list_source : public dataspan_source
+{
+public:
+	explicit dataspan_list_source(const dataspan_list &spans) :
+		m_spans(spans), m_next(0) {}
+	virtual bool next_span(dataspan &span)
+	{
+		if (m_next >= m_spans.size()) return false;
+		span = m_spans[m_next++];
+		return true;
+	}
+private:
+	const dataspan_list &m_spans;
+	size_t m_next;
+};
+
+// Destination of data arriving from the bus, e.g. a file being saved.
+// Bytes are collected into sector sized chunks before write().
+class datasink
+{
+public:
+	datasink() : m_len(0) {}
+	virtual ~datasink() {}
+	void put(unsigned char c)
+	{
+		m_chunk[m_len++] = c;
+		if (m_len == sizeof m_chunk) flush_chunk();
+	}
+	void flush_chunk()
+	{
+		if (m_len > 0) write(m_chunk, m_len);
+		m_len = 0;
+	}
+	// Make the data written so far the complete file
+	virtual void commit() = 0;
+protected:
+	virtual void write(const unsigned char *data, size_t len) = 0;
+private:
+	unsigned char m_chunk[254];
+	size_t m_len;
+};
+
+// Output iterator putting bytes into a datasink
+class datasink_iterator
+{
+public:
+	typedef std::output_iterator_tag iterator_category;
+	typedef void value_type;
+	typedef void difference_type;
+	typedef void pointer;
+	typedef void reference;
+
+	explicit datasink_iterator(datasink &sink) : m_sink(&sink) {}
+	datasink_iterator& operator=(unsigned char c) { m_sink->put(c); return *this; }
+	datasink_iterator& operator*() { return *this; }
+	datasink_iterator& operator++() { return *this; }
+	datasink_iterator& operator++(int) { return *this; }
+private:
+	datasink *m_sink;
+};
+
 #endif /* RASPBIEC_TYPES_H */
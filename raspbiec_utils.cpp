@@ -20,14 +20,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <sys/statvfs.h>
 #include <fcntl.h>
-#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <string.h>
 #include <errno.h>
 #include <iterator>
+#include <algorithm>
 #include "raspbiec_utils.h"
 #include "raspbiec_common.h"
-#include "raspbiec_diskimage.h"
 #include "raspbiec_exception.h"
 
 // PETSCII -> ASCII printable chars
@@ -287,7 +289,7 @@ int open_local_file(const char *name, const char* mode)
 		throw raspbiec_error(IEC_FILE_READ_ERROR);
 	}
 #endif
-    return 0;
+    return fd;
 }
 
 void close_local_file(int& handle)
@@ -311,481 +313,328 @@ bool local_file_exists(const char *name)
     return false;
 }
 
-size_t read_from_local_file(const int handle, std::vector<unsigned char> &data, size_t amount)
+local_file_reader::local_file_reader(int fd) :
+		m_fd(fd),
+		m_read(0),
+		m_handed(0),
+		m_eof(false),
+		m_stop(false),
+		m_status(IEC_OK)
 {
-	ssize_t rd = 0;
-	if (handle >= 0)
-	{
-		data.resize(amount);
-		rd = read(handle, data.data(), amount);
-		if (read < 0)
-		{
-			fprintf(stderr, "Read error, errno %d", errno);
-			throw raspbiec_error(IEC_FILE_READ_ERROR);
-		}
-
-		data.resize(rd);
-	}
-	return rd;
-}
+	if (m_fd < 0)
+		throw raspbiec_error(IEC_FILE_NOT_FOUND);
 
-const_databuf_iter write_to_local_file(const int handle, const_databuf_iter begin, const_databuf_iter end)
-{
-	ssize_t written = 0;
-	const_databuf_iter position = begin;
-	if (handle >= 0)
+	posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	if (pthread_create(&m_thread, NULL, read_thread, this) != 0)
 	{
-		written = write(handle, &(*begin), &(*end) - &(*begin));
-		if (written < 0)
-		{
-			fprintf(stderr, "Write error, errno %d", errno);
-			throw raspbiec_error(IEC_FILE_WRITE_ERROR);
-		}
-		std::advance(position, written);
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_lock);
+		throw raspbiec_error(IEC_OUT_OF_MEMORY);
 	}
-	return position;
 }
 
-static const int16_t header_line[] =
-{ 0x01, 0x04, 0x01, 0x01, 0x00, 0x00, 0x12, 0x22,
-  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-  0x22, 0x20, 0x30, 0x30, 0x20, 0x32, 0x41, 0x00, -1 };
-
-static const int16_t file_line[] =
-{ 0x01, 0x01,   -2,   -3, 0x20, 0x22,   -4,   -4,
-    -4,   -4,   -4,   -4,   -4,   -4,   -4,   -4,
-    -4,   -4,   -4,   -4,   -4,   -4,   -5, 0x20,
-  0x50, 0x52, 0x47, 0x20, 0x20, 0x20, 0x20, 0x00, -1 };
-
-static const int16_t footer_line[] =
-{ 0x01, 0x01,   -2,   -3, 0x42, 0x4C, 0x4F, 0x43,
-  0x4B, 0x53, 0x20, 0x46, 0x52, 0x45, 0x45, 0x2E,
-  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-  0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, -1 };
-
-void read_local_dir(databuf_t &buf, const char *dirname, bool verbose)
+local_file_reader::~local_file_reader()
 {
-    const int16_t *p;
-
-    fdptr<DIR,int(*)(DIR*)>
-	dirp( opendir(dirname), closedir );
-    if (!dirp)
-    {
-        throw raspbiec_error(IEC_FILE_NOT_FOUND);
-    }
-
-    // Construct a BASIC listing from the directory info
-    for (p = header_line; *p != -1; ++p)
-    {
-        buf.push_back(*p);
-        if (verbose) printf("%c", petscii2ascii(*p));
-    }
-    if (verbose) printf("\n");
-
-    struct stat sb;
-    struct dirent *dp;
-    while ((dp = readdir(dirp)) != NULL)
-    {
-        if (fstatat(dirfd(dirp),dp->d_name,&sb,AT_NO_AUTOMOUNT) == -1)
-            continue;
-        int blocks = (sb.st_size + 253) / 254;
-        if (blocks > 65535)
-            blocks = 65535;
-
-        int i=0;
-        for (p = file_line; *p != -1; ++p)
-        {
-            switch(*p)
-            {
-            default:
-                buf.push_back(*p);
-                if (verbose) printf("%c", petscii2ascii(*p));
-                break;
-            case -2: // Blocks LSB
-                buf.push_back(blocks % 256);
-                break;
-            case -3: // Blocks MSB
-                buf.push_back(blocks / 256);
-                if (verbose) printf("%d",blocks);
-                if (blocks < 100)
-                {
-                    buf.push_back(0x20);
-                    if (verbose) printf(" ");
-                }
-                if (blocks < 10)
-                {
-                    buf.push_back(0x20);
-                    if (verbose) printf(" ");
-                }
-                break;
-            case -5: // Filename length hard limit
-                if (i>=0) i=-1;
-            case -4: // State machine for name writing
-                if (i>=0)
-                {
-                    char c = dp->d_name[i++];
-                    if (c=='\0') i=-1;
-                    else
-                    {
-                        buf.push_back(ascii2petscii(c));
-                        if (verbose) printf("%c",c);
-                    }
-                }
-                if (i==-1)
-                {
-                    buf.push_back(0x22);
-                    if (verbose) printf("\"");
-                    i=-2;
-                }
-                else if (i==-2)
-                {
-                    buf.push_back(0x20);
-                    printf(" ");
-                }
-                break;
-            }
-        }
-        if (verbose) printf("\n");
-    }
-
-    unsigned long freeblocks = 0;
-    struct statvfs sfb;
-    if (statvfs(dirname, &sfb)==0)
-    {
-        freeblocks = sfb.f_bavail * (sfb.f_bsize/256);
-        if (freeblocks > 65535)
-            freeblocks = 65535;
-    }
-
-    for (p = footer_line; *p != -1; ++p)
-    {
-        switch(*p)
-        {
-        default:
-            buf.push_back(*p);
-            if (verbose) printf("%c", petscii2ascii(*p));
-            break;
-        case -2: // Freeblocks LSB
-            buf.push_back(freeblocks % 256);
-            break;
-        case -3: // Freeblocks MSB
-            buf.push_back(freeblocks / 256);
-            if (verbose) printf("%lu ",freeblocks);
-            if (freeblocks < 100)
-            {
-                buf.push_back(0x20);
-                if (verbose) printf(" ");
-            }
-            if (freeblocks < 10)
-            {
-                buf.push_back(0x20);
-                if (verbose) printf(" ");
-            }
-            break;
-        }
-    }
-    if (verbose) printf("\n");
+	pthread_mutex_lock(&m_lock);
+	m_stop = true;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(m_thread, NULL);
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
 }
 
-static const int16_t header_line_diskimage[] =
-{ 0x01, 0x04, 0x01, 0x01, 0x00, 0x00, 0x12, 0x22,
-    -4,   -4,   -4,   -4,   -4,   -4,   -4,   -4,
-    -4,   -4,   -4,   -4,   -4,   -4,   -4,   -4,
-    -5,   -4,   -4,   -4,   -4,   -4,   -4, 0x00, -1 };
-
-void read_diskimage_dir(
-    std::vector<unsigned char> &buf,
-    Diskimage& diskimage,
-    bool verbose)
-
+bool local_file_reader::next_span(dataspan &span)
 {
-    const int16_t *p;
-
-    Diskimage::Dirstate dirstate;
-    Diskimage::Direntry direntry;
-
-    if (!diskimage.opendir(dirstate))
-    {
-        throw raspbiec_error(IEC_DISK_IMAGE_ERROR);
-    }
-
-    // Construct a BASIC listing from the directory info
-
-    int i=0;
-    for (p = header_line_diskimage; *p != -1; ++p)
-    {
-        switch(*p)
-        {
-        default:
-            buf.push_back(*p);
-            if (verbose) printf("%c", petscii2ascii(*p));
-            break;
-
-        case -4: // State machine for name writing
-        {
-            char c = dirstate.name_id[i++];
-            if (c==0xA0) c=0x20;
-            buf.push_back(c);
-            if (verbose) printf("%c",petscii2ascii(c));
-            break;
-        }
-
-        case -5: // Diskname end quote
-            ++i;
-            buf.push_back(0x22);
-            if (verbose) printf("%c",petscii2ascii(0x22));
-            break;
-        }
-    }
-    if (verbose) printf("\n");
-
-    while (diskimage.readdir(dirstate,direntry))
-    {
-        if (direntry.filetype == 0x00)
-            continue; // TODO: filetypes
-
-        int blocks = direntry.size_hi * 0x100 + direntry.size_lo;
-
-        i=0;
-        for (p = file_line; *p != -1; ++p)
-        {
-            switch(*p)
-            {
-            default:
-                buf.push_back(*p);
-                if (verbose) printf("%c", petscii2ascii(*p));
-                break;
-            case -2: // Blocks LSB
-                buf.push_back(direntry.size_lo);
-                break;
-            case -3: // Blocks MSB
-                buf.push_back(direntry.size_hi);
-                if (verbose) printf("%d",blocks);
-                if (blocks < 100)
-                {
-                    buf.push_back(0x20);
-                    if (verbose) printf(" ");
-                }
-                if (blocks < 10)
-                {
-                    buf.push_back(0x20);
-                    if (verbose) printf(" ");
-                }
-                break;
-            case -5: // Filename length hard limit
-                if (i>=0) i=-1;
-            case -4: // State machine for name writing
-                if (i>=0)
-                {
-                    char c = direntry.name[i++];
-                    if (c==0xA0) i=-1;
-                    else
-                    {
-                        buf.push_back(c);
-                        if (verbose) printf("%c",petscii2ascii(c));
-                    }
-                }
-                if (i==-1)
-                {
-                    buf.push_back(0x22);
-                    if (verbose) printf("\"");
-                    i=-2;
-                }
-                else if (i==-2)
-                {
-                    buf.push_back(0x20);
-                    if (verbose) printf(" ");
-                }
-                break;
-            }
-        }
-        if (verbose) printf("\n");
-    }
+	pthread_mutex_lock(&m_lock);
+	// The chunk handed out two calls ago can be reused now
+	pthread_cond_broadcast(&m_cond);
+	while (m_read == m_handed && !m_eof && m_status == IEC_OK)
+	{
+		pthread_cond_wait(&m_cond, &m_lock);
+	}
+	int status = m_status;
+	bool more = (m_read > m_handed);
+	if (more && status == IEC_OK)
+	{
+		const databuf_t &chunk = m_chunks[m_handed % num_chunks];
+		span.data = chunk.data();
+		span.len = chunk.size();
+		++m_handed;
+	}
+	pthread_mutex_unlock(&m_lock);
 
-    for (p = footer_line; *p != -1; ++p)
-    {
-        switch(*p)
-        {
-        default:
-            buf.push_back(*p);
-            if (verbose) printf("%c", petscii2ascii(*p));
-            break;
-        case -2: // Freeblocks LSB
-            buf.push_back(dirstate.free_lo);
-            break;
-        case -3: // Freeblocks MSB
-            buf.push_back(dirstate.free_hi);
-            int freeblocks = dirstate.free_hi * 0x100 + dirstate.free_lo;
-            if (verbose) printf("%d ",freeblocks);
-            if (freeblocks < 100)
-            {
-                buf.push_back(0x20);
-                if (verbose) printf(" ");
-            }
-            if (freeblocks < 10)
-            {
-                buf.push_back(0x20);
-                if (verbose) printf(" ");
-            }
-            break;
-        }
-    }
-    if (verbose) printf("\n");
+	if (status != IEC_OK)
+		throw raspbiec_error(status);
+	return more;
 }
 
-/*********************************************************************/
-
-static const char* raspbiecdevname = "/dev/raspbiec";
-
-
-pipefd::pipefd() :
-		m_fd_size(1)
+void *local_file_reader::read_thread(void *arg)
 {
-	for (int i=0; i<4; ++i) m_fd[i] = -1;
+	static_cast<local_file_reader *>(arg)->read_ahead();
+	return NULL;
 }
 
-pipefd::~pipefd()
+void local_file_reader::read_ahead()
 {
-	close_pipe();
+	off_t offset = lseek(m_fd, 0, SEEK_CUR);
+	pthread_mutex_lock(&m_lock);
+	while (!m_stop)
+	{
+		// Chunks m_handed-2 and m_handed-1 may still be in use and
+		// the ones from m_handed on are waiting to be handed out
+		if (m_read + 2 >= m_handed + num_chunks)
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+			continue;
+		}
+		databuf_t &chunk = m_chunks[m_read % num_chunks];
+		pthread_mutex_unlock(&m_lock);
+
+		size_t rd = 0;
+		int status = IEC_OK;
+		try
+		{
+			rd = read_from_local_file(m_fd, chunk, chunk_size);
+		}
+		catch (raspbiec_error &e)
+		{
+			status = e.status();
+		}
+		if (rd > 0 && offset >= 0)
+		{
+			// Let the kernel start on the chunk after this one
+			offset += rd;
+			posix_fadvise(m_fd, offset, chunk_size, POSIX_FADV_WILLNEED);
+		}
+
+		pthread_mutex_lock(&m_lock);
+		if (status != IEC_OK)
+		{
+			m_status = status;
+		}
+		else if (rd == 0)
+		{
+			m_eof = true;
+		}
+		else
+		{
+			++m_read;
+		}
+		pthread_cond_broadcast(&m_cond);
+		if (m_eof || m_status != IEC_OK) break;
+	}
+	pthread_mutex_unlock(&m_lock);
 }
 
-void pipefd::move(pipefd &other)
+static mode_t current_umask()
 {
-	close_pipe();
-	for (int i=0; i<4; ++i) m_fd[i] = other.m_fd[i];
-	m_fd_size = other.m_fd_size;
-	for (int i=0; i<4; ++i) other.m_fd[i] = -1;
-	other.m_fd_size = 1;
+	mode_t mask = umask(0);
+	umask(mask);
+	return mask;
 }
 
-void pipefd::close_pipe()
+local_file_writer::local_file_writer(const char *name) :
+		m_name(name),
+		m_tmpname(std::string(name) + ".XXXXXX"),
+		m_fd(-1),
+		m_chunks(max_chunks),
+		m_head(0),
+		m_tail(0),
+		m_stop(false),
+		m_error(0),
+		m_committed(false),
+		m_size(0)
 {
-	for (int i=0; i<m_fd_size; ++i)
+	m_fd = mkstemp(&m_tmpname[0]);
+	if (m_fd < 0)
 	{
-		if (m_fd[i] >= 0) ::close(m_fd[i]);
+		fprintf(stderr,"Could not create local file '%s'\n",name);
+		throw raspbiec_error(IEC_FILE_WRITE_ERROR);
 	}
-	for (int i=0; i<2; ++i)
+	fchmod(m_fd, 0666 & ~current_umask());
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	if (pthread_create(&m_thread, NULL, flush_thread, this) != 0)
 	{
-		m_fd[i] = -1;
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_lock);
+		close(m_fd);
+		unlink(m_tmpname.c_str());
+		throw raspbiec_error(IEC_OUT_OF_MEMORY);
 	}
-	m_fd_size = 1;
 }
 
-void pipefd::open_pipe()
+local_file_writer::~local_file_writer()
 {
-	close_pipe();
-    m_fd_size = 4;
-    if (pipe(&m_fd[0]) == -1 ||
-    	pipe(&m_fd[2]) == -1)
-    {
-    	close_pipe();
-		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
-    }
+	stop();
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+	if (m_fd >= 0) close(m_fd);
+	if (!m_committed) unlink(m_tmpname.c_str());
 }
 
-void pipefd::open_dev()
+// Queue a chunk, waits only if the file is more than max_chunks behind
+void local_file_writer::write(const unsigned char *data, size_t len)
 {
-	close_pipe();
-	int fd_dev = open(raspbiecdevname, O_RDWR);
-	if (fd_dev < 0)
+	m_size += len;
+	pthread_mutex_lock(&m_lock);
+	while (m_head - m_tail == max_chunks && m_error == 0)
 	{
-		int deverr = errno;
-		fprintf(stderr,"Cannot open %s\n",raspbiecdevname);
-		if (deverr == EREMOTEIO)
-			throw raspbiec_error(IEC_BUS_NOT_IDLE);
-		else
-			throw raspbiec_error(IEC_DRIVER_NOT_PRESENT);
+		pthread_cond_wait(&m_cond, &m_lock);
+	}
+	if (m_error == 0)
+	{
+		chunk &c = m_chunks[m_head % max_chunks];
+		std::copy(data, data + len, c.data);
+		c.len = len;
+		++m_head;
+		pthread_cond_broadcast(&m_cond);
 	}
-	m_fd[0] = fd_dev;
+	pthread_mutex_unlock(&m_lock);
 }
 
-bool pipefd::is_open_directional()
+void local_file_writer::commit()
 {
-	if (is_device()) // bidirectional
+	flush_chunk();
+	stop();
+	if (m_error == 0 && fdatasync(m_fd) == -1) m_error = errno;
+	if (close(m_fd) == -1 && m_error == 0) m_error = errno;
+	m_fd = -1;
+	if (m_error == 0 && rename(m_tmpname.c_str(), m_name.c_str()) == -1) m_error = errno;
+	if (m_error != 0)
 	{
-		return (m_fd[0] >= 0);
+		fprintf(stderr, "Could not save '%s', errno %d\n", m_name.c_str(), m_error);
+		throw raspbiec_error(IEC_FILE_WRITE_ERROR);
 	}
-	// two unidirectional pipes, 0 and 3 or 1 and 2
-	if (m_fd[0] >= 0 && m_fd[1] < 0 && m_fd[2] < 0 && m_fd[3] >= 0) return true;
-	if (m_fd[0] < 0 && m_fd[1] >= 0 && m_fd[2] >= 0 && m_fd[3] < 0) return true;
-	return false;
+	m_committed = true;
 }
 
-bool pipefd::is_open_nondirectional()
+// Wait until everything queued is in the file
+void local_file_writer::stop()
 {
-	for (int i=0; i<m_fd_size; ++i) if (m_fd[i] < 0) return false;
-	return true;
+	pthread_mutex_lock(&m_lock);
+	bool running = !m_stop;
+	m_stop = true;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	if (running) pthread_join(m_thread, NULL);
 }
 
-bool pipefd::is_device()
+void *local_file_writer::flush_thread(void *arg)
 {
-    return 1 == m_fd_size;
+	static_cast<local_file_writer *>(arg)->flush();
+	return NULL;
 }
 
-void pipefd::set_write(int *fd)
+// Write out all queued chunks with one writev() at a time
+void local_file_writer::flush()
 {
-	if (fd[0] >= 0)
+	pthread_mutex_lock(&m_lock);
+	for (;;)
 	{
-		close(fd[0]); // Close unused read end
-		fd[0] = -1;
-	}
-	if (fd[1] < 0) // Check write end is open
-	{
-		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+		while (m_head == m_tail && !m_stop)
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+		}
+		if (m_head == m_tail || m_error != 0) break; // Stopped and all done
+
+		size_t first = m_tail;
+		size_t count = std::min(m_head - m_tail, (size_t)IOV_MAX);
+		pthread_mutex_unlock(&m_lock);
+
+		// The chunks between tail and head are not touched by write()
+		struct iovec iov[IOV_MAX];
+		size_t total = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			chunk &c = m_chunks[(first + i) % max_chunks];
+			iov[i].iov_base = c.data;
+			iov[i].iov_len = c.len;
+			total += c.len;
+		}
+		int error = 0;
+		struct iovec *v = iov;
+		int vcnt = count;
+		while (total > 0)
+		{
+			ssize_t wr = writev(m_fd, v, vcnt);
+			if (wr < 0 && errno == EINTR) continue;
+			if (wr <= 0)
+			{
+				error = (wr < 0) ? errno : EIO;
+				break;
+			}
+			total -= wr;
+			// Skip what was written
+			while (vcnt > 0 && (size_t)wr >= v->iov_len)
+			{
+				wr -= v->iov_len;
+				++v;
+				--vcnt;
+			}
+			if (vcnt > 0)
+			{
+				v->iov_base = (unsigned char *)v->iov_base + wr;
+				v->iov_len -= wr;
+			}
+		}
+
+		pthread_mutex_lock(&m_lock);
+		m_tail += count;
+		if (error != 0) m_error = error;
+		pthread_cond_broadcast(&m_cond);
 	}
+	pthread_mutex_unlock(&m_lock);
 }
 
-void pipefd::set_read(int *fd)
+size_t read_from_local_file(const int handle, std::vector<unsigned char> &data, size_t amount)
 {
-	if (fd[1] >= 0)
-	{
-		close(fd[1]); // Close unused write end
-		fd[1] = -1;
-	}
-	if (fd[0] < 0) // Check read end is open
+	ssize_t rd = 0;
+	if (handle >= 0)
 	{
-		throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
+		data.resize(amount);
+		rd = read(handle, data.data(), amount);
+		if (rd < 0)
+		{
+			fprintf(stderr, "Read error, errno %d", errno);
+			throw raspbiec_error(IEC_FILE_READ_ERROR);
+		}
+
+		data.resize(rd);
 	}
+	return rd;
 }
 
-void pipefd::set_direction(bool fwd)
+const_databuf_iter write_to_local_file(const int handle, const_databuf_iter begin, const_databuf_iter end)
 {
-	if (!is_device()) // two unidirectional pipes
+	ssize_t written = 0;
+	const_databuf_iter position = begin;
+	if (handle >= 0)
 	{
-		if (fwd) // these directions are arbitrary
-		{
-			set_write(&m_fd[0]);
-			set_read(&m_fd[2]);
-		}
-		else
+		written = write(handle, &(*begin), &(*end) - &(*begin));
+		if (written < 0)
 		{
-			set_read(&m_fd[0]);
-			set_write(&m_fd[2]);
+			fprintf(stderr, "Write error, errno %d", errno);
+			throw raspbiec_error(IEC_FILE_WRITE_ERROR);
 		}
+		std::advance(position, written);
 	}
+	return position;
 }
 
-int pipefd::write_end()
+long long monotonic_ms(void)
 {
-	if (!is_open_directional()) throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
-
-	if (is_device()) // bidirectional
-	{
-		return m_fd[0];
-	}
-	// two unidirectional pipes
-	return (m_fd[1] >= 0) ? m_fd[1] : m_fd[3];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-int pipefd::read_end()
+long long monotonic_us(void)
 {
-	if (!is_open_directional()) throw raspbiec_error(IEC_DEVICE_NOT_PRESENT);
-
-	if (is_device()) // bidirectional
-	{
-		return m_fd[0];
-	}
-	// two unidirectional pipes
-	return (m_fd[0] >= 0) ? m_fd[0] : m_fd[2];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
@@ -21,6 +21,8 @@
 
 #include <vector>
 #include <string>
+#include <sys/types.h>
+#include <pthread.h>
 #include "raspbiec_diskimage.h"
 #include "raspbiec_common.h"
 #include "raspbiec_types.h"
@@ -54,39 +56,88 @@ void close_local_file(int& handle);
 
 bool local_file_exists(const char *name);
 
-// Read <amount> of data from file, replace data in <data>
-size_t read_from_local_file(const int handle, databuf_t &data, size_t amount);
-// Write <data> to file, return written amount
-const_databuf_iter write_to_local_file(const int handle, const_databuf_iter begin, const_databuf_iter end);
-
-void read_local_dir(databuf_t &buf, const char *dirname, bool verbose);
-
-void read_diskimage_dir(databuf_t &buf, Diskimage& diskimage, bool verbose);
-
-class pipefd
+// Reads an open local file ahead in a background thread while the
+// previous chunks are being sent, only a few chunks are in memory
+class local_file_reader : public dataspan_source
 {
 public:
-	pipefd();
-	~pipefd();
-	void move(pipefd &other);
-	void open_pipe();
-	void open_dev();
-	void close_pipe();
-	bool is_open_directional();
-	bool is_open_nondirectional();
-	bool is_device();
-	int write_end();
-	int read_end();
-	void set_direction_A_to_B() { set_direction(true); }
-	void set_direction_B_to_A() { set_direction(false); }
+	explicit local_file_reader(int fd);
+	~local_file_reader();
+	virtual bool next_span(dataspan &span);
 private:
-	bool all_open();
-	void set_write(int *fd);
-	void set_read(int *fd);
-	void set_direction(bool fwd);
+	local_file_reader(const local_file_reader &);
+	local_file_reader& operator=(const local_file_reader &);
+
+	static void *read_thread(void *arg);
+	void read_ahead();
+
+	// One chunk on the bus, one as lookahead, one being read
+	static const int num_chunks = 3;
+	static const size_t chunk_size = 16384;
+
+	int m_fd;
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	databuf_t m_chunks[num_chunks];
+	unsigned long m_read;   // Chunks read from the file
+	unsigned long m_handed; // Chunks handed out by next_span()
+	bool m_eof;
+	bool m_stop;
+	int m_status; // Read error, IEC_OK if none
+};
 
-	int m_fd[4];
-	int m_fd_size; // 1 == dev, 4 == two pipes
+// Saves a local file from a background thread so that the bus never
+// waits on storage. The data goes to a temporary file which commit()
+// renames in place; without commit() the temporary file is removed.
+class local_file_writer : public datasink
+{
+public:
+	explicit local_file_writer(const char *name);
+	~local_file_writer();
+	virtual void commit();
+	// Bytes handed over for writing so far
+	size_t size() const { return m_size; }
+protected:
+	virtual void write(const unsigned char *data, size_t len);
+private:
+	local_file_writer(const local_file_writer &);
+	local_file_writer& operator=(const local_file_writer &);
+
+	static void *flush_thread(void *arg);
+	void flush();
+	void stop();
+
+	struct chunk
+	{
+		unsigned char data[254];
+		size_t len;
+	};
+	static const size_t max_chunks = 256; // Bounds the memory used
+
+	std::string m_name;
+	std::string m_tmpname;
+	int m_fd;
+	pthread_t m_thread;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	std::vector<chunk> m_chunks; // Ring of queued chunks
+	size_t m_head; // Next chunk to fill
+	size_t m_tail; // Next chunk to write to file
+	bool m_stop;
+	int m_error; // errno of a failed write, 0 if none
+	bool m_committed;
+	size_t m_size;
 };
 
+// Read <amount> of data from file, replace data in <data>
+size_t read_from_local_file(const int handle, databuf_t &data, size_t amount);
+// Write <data> to file, return written amount
+const_databuf_iter write_to_local_file(const int handle, const_databuf_iter begin, const_databuf_iter end);
+
+// Milliseconds from an arbitrary starting point, for timeouts
+long long monotonic_ms(void);
+// Microseconds from the same starting point, for measurements
+long long monotonic_us(void);
+
 #endif // RASPBIEC_UTILS_H
@@ -47,6 +47,7 @@
 #include <linux/hrtimer.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/poll.h>
 #include "raspbiecdrv.h"
 
 /* Module information */
@@ -66,6 +67,17 @@ static DEFINE_MUTEX(raspbiec_device_mutex);
 static DECLARE_KFIFO(raspbiec_read_fifo, int16_t, RASPBIEC_READ_FIFO_SIZE);
 static DECLARE_KFIFO(raspbiec_write_fifo, int16_t, RASPBIEC_WRITE_FIFO_SIZE);
 
+/* Stream format of read()/write(), selected with an ioctl.
+ * The fifos always hold int16_t entries, the framed format is
+ * translated at the user boundary through these buffers. */
+static int stream_format = IEC_FORMAT_INT16;
+static unsigned char read_frames[IEC_FRAME_MAX_SIZE(RASPBIEC_READ_FIFO_SIZE)];
+static int16_t read_entries[RASPBIEC_READ_FIFO_SIZE];
+static unsigned char write_frames[IEC_FRAME_MAX_SIZE(RASPBIEC_WRITE_FIFO_SIZE)];
+static int16_t write_entries[RASPBIEC_WRITE_FIFO_SIZE];
+/* Frames may continue from one write() to the next */
+static struct iec_frame_decoder write_decoder;
+
 /* Wait queues for blocking I/O */
 DECLARE_WAIT_QUEUE_HEAD(readq);
 DECLARE_WAIT_QUEUE_HEAD(writeq);
@@ -329,6 +341,8 @@ static int raspbiec_device_open(struct inode* inode, struct file* filp)
     /* Clear any errors upon opening */
     kfifo_reset(&raspbiec_read_fifo);
     kfifo_reset(&raspbiec_write_fifo);
+    stream_format = IEC_FORMAT_INT16;
+    iec_frame_decoder_init(&write_decoder);
     device_type = DEV_COMPUTER;
     current_state = IEC_RESET;
     raspbiec_state_machine(iec_user,-1);
@@ -362,6 +376,7 @@ static ssize_t raspbiec_device_read(struct file* filp,
 {
     int fifoerr;
     unsigned int copied;
+    ssize_t retlen;
 
     while (kfifo_is_empty(&raspbiec_read_fifo))
     {
@@ -383,14 +398,33 @@ static ssize_t raspbiec_device_read(struct file* filp,
         return -EIO;
     }
 
-    fifoerr = kfifo_to_user(&raspbiec_read_fifo,
-                            buffer,
-                            length,
-                            &copied);
-    /* Ignore short reads (but warn about them) */
-    if (length > copied)
+    if (stream_format == IEC_FORMAT_FRAMED)
+    {
+        /* Encode as many entries as fit in the user buffer and
+         * only then remove them from the fifo */
+        size_t entries = kfifo_out_peek(&raspbiec_read_fifo,
+                                        read_entries,
+                                        RASPBIEC_READ_FIFO_SIZE);
+        size_t bytes = iec_frame_encode(read_entries, &entries, read_frames,
+                                        min(length, sizeof read_frames));
+        if (entries == 0)
+            return -EINVAL; /* Buffer too small for a single frame */
+        copied = kfifo_out(&raspbiec_read_fifo, read_entries, entries);
+        fifoerr = copy_to_user(buffer, read_frames, bytes) ? -EFAULT : 0;
+        retlen = bytes;
+    }
+    else
     {
-        msg(1,"short read detected\n");
+        fifoerr = kfifo_to_user(&raspbiec_read_fifo,
+                                buffer,
+                                length,
+                                &copied);
+        retlen = copied;
+        /* Ignore short reads (but warn about them) */
+        if (length > copied)
+        {
+            msg(1,"short read detected\n");
+        }
     }
 
     if (notify_error == iec_send_error_code && copied >= 1)
@@ -404,7 +438,23 @@ static ssize_t raspbiec_device_read(struct file* filp,
 
     talk_interrupted = false;
 
-    return fifoerr ? fifoerr : copied;
+    return fifoerr ? fifoerr : retlen;
+}
+
+/* Bytes of frames in[0..len) which decode to the first <entries> */
+static size_t framed_bytes(const struct iec_frame_decoder *start,
+                           const unsigned char *in, size_t len,
+                           unsigned int entries)
+{
+    struct iec_frame_decoder d = *start;
+    int16_t entry;
+    size_t i;
+
+    for (i = 0; i < len && entries > 0; ++i)
+    {
+        entries -= iec_frame_decode(&d, in + i, 1, &entry);
+    }
+    return i;
 }
 
 /*-------------------------------------------------------------------*/
@@ -418,6 +468,10 @@ static ssize_t raspbiec_device_write(struct file* filp,
     unsigned int copied;
     unsigned int datalen;
     unsigned int sent;
+    struct iec_frame_decoder framed_start = write_decoder;
+    size_t framed_used = 0;
+    unsigned int framed_before = 0;
+    bool interrupted;
 
     if (notify_error == iec_return_eio)
     {
@@ -430,6 +484,7 @@ static ssize_t raspbiec_device_write(struct file* filp,
     {
         msg(3,"raspbiec: write talk_interrupted\n");
         kfifo_reset(&raspbiec_write_fifo);
+        iec_frame_decoder_init(&write_decoder);
         return 0;
         /* When talk_interrupted is true it means ATN was asserted
          * during sending. Do a read to acknowledge.
@@ -452,10 +507,38 @@ static ssize_t raspbiec_device_write(struct file* filp,
         msg(3,"raspbiec: write unblocked ++++++\n");
     }
 
-    err = kfifo_from_user(&raspbiec_write_fifo,
-                          buffer,
-                          length,
-                          &copied);
+    if (stream_format == IEC_FORMAT_FRAMED)
+    {
+        /* Take only as many frames as the fifo has room for and
+         * return the bytes used, like a write to a byte stream */
+        long entries;
+
+        if (length > sizeof write_frames)
+            length = sizeof write_frames;
+        if (copy_from_user(write_frames, buffer, length))
+            return -EFAULT;
+        framed_used = length;
+        entries = iec_frame_decode_some(&write_decoder, write_frames,
+                                        &framed_used, write_entries,
+                                        kfifo_avail(&raspbiec_write_fifo));
+        if (entries < 0)
+        {
+            iec_frame_decoder_init(&write_decoder);
+            msg(1,"illegal frame in write\n");
+            return -EINVAL;
+        }
+        err = 0;
+        framed_before = kfifo_len(&raspbiec_write_fifo);
+        copied = kfifo_in(&raspbiec_write_fifo, write_entries, entries);
+        length = entries; /* All fit, the check below only warns */
+    }
+    else
+    {
+        err = kfifo_from_user(&raspbiec_write_fifo,
+                              buffer,
+                              length,
+                              &copied);
+    }
     /* Ignore short writes (but warn about them) */
     if (length > copied)
     {
@@ -487,6 +570,7 @@ static ssize_t raspbiec_device_write(struct file* filp,
 
     sent = datalen - kfifo_len(&raspbiec_write_fifo);
 
+    interrupted = talk_interrupted;
     if (talk_interrupted)
     {
         msg(3,"raspbiec: write talk_interrupted\n");
@@ -494,13 +578,77 @@ static ssize_t raspbiec_device_write(struct file* filp,
         talk_interrupted = false;
     }
 
+    if (stream_format == IEC_FORMAT_FRAMED && err == 0)
+    {
+        if (!interrupted)
+            return framed_used;
+        /* The rest is discarded, return the bytes up to the last
+         * entry which was sent */
+        iec_frame_decoder_init(&write_decoder);
+        sent = (sent > framed_before) ? sent - framed_before : 0;
+        return framed_bytes(&framed_start, write_frames, framed_used, sent);
+    }
     return (err != 0) ? err : sent;
 }
 
+/*-------------------------------------------------------------------*/
+static unsigned int raspbiec_device_poll(struct file* filp,
+                                         poll_table *wait)
+/*-------------------------------------------------------------------*/
+{
+    unsigned int mask = 0;
+
+    /* The state machine wakes these queues whenever it moves
+     * data in or out of the fifos, so userspace can sleep here
+     * instead of polling the device with a timer */
+    poll_wait(filp, &readq, wait);
+    poll_wait(filp, &writeq, wait);
+
+    if (!kfifo_is_empty(&raspbiec_read_fifo))
+        mask |= POLLIN | POLLRDNORM;
+    /* A write returns immediately when talk has been interrupted */
+    if (!kfifo_is_full(&raspbiec_write_fifo) || talk_interrupted)
+        mask |= POLLOUT | POLLWRNORM;
+    if (notify_error == iec_return_eio)
+        mask |= POLLERR;
+
+    return mask;
+}
+
+/*-------------------------------------------------------------------*/
+static long raspbiec_device_ioctl(struct file* filp,
+                                  unsigned int cmd,
+                                  unsigned long arg)
+/*-------------------------------------------------------------------*/
+{
+    int format;
+
+    switch (cmd)
+    {
+    case RASPBIEC_IOC_SET_FORMAT:
+        if (copy_from_user(&format, (int __user *)arg, sizeof format))
+            return -EFAULT;
+        if (format != IEC_FORMAT_INT16 && format != IEC_FORMAT_FRAMED)
+            return -EINVAL;
+        /* Only switch between whole entries */
+        if (!kfifo_is_empty(&raspbiec_read_fifo) ||
+            !kfifo_is_empty(&raspbiec_write_fifo))
+            return -EBUSY;
+        stream_format = format;
+        iec_frame_decoder_init(&write_decoder);
+        msg(1,"stream format %d\n", stream_format);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 static struct file_operations fops =
 {
     .read    = raspbiec_device_read,
     .write   = raspbiec_device_write,
+    .poll    = raspbiec_device_poll,
+    .unlocked_ioctl = raspbiec_device_ioctl,
     .open    = raspbiec_device_open,
     .release = raspbiec_device_release
 };
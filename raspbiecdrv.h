@@ -20,11 +20,10 @@
 #define RASPBIECDRV_H
 
 #include "raspbiec_common.h"
+#include "raspbiec_frame.h"
 
 #define DEVICE_NAME "device"
 #define CLASS_NAME "raspbiec"
-#define RASPBIEC_READ_FIFO_SIZE 1024
-#define RASPBIEC_WRITE_FIFO_SIZE 1024
 
 /* Voltages on IEC bus */
 #define IEC_LO    0